@@ -1,249 +1,172 @@
 #pragma once
 
 #include <hmcos/core/vertex.hpp>
+#include <numeric>
 
 namespace hmcos {
 
-/// Node in dominator tree
-template <class Vert>
-class DomNode {
+/// Compute immediate dominators of nodes numbered in depth-first pre-order with
+/// Semi-NCA algorithm. Node 0 is root, which is its own immediate dominator.
+/// `parent` is parent of each node in depth-first spanning tree, and
+/// `forEachPred(v, f)` calls `f` with number of each predecessor of node `v`.
+template <class PredFunc>
+std::vector<uint32_t> SemiNcaIDom(const std::vector<uint32_t> &parent,
+                                  PredFunc forEachPred);
+
+/// Dominator tree of vertices, stored in arrays indexed by vertex ID
+/// The tree is built with Semi-NCA algorithm. See "Finding Dominators in
+/// Practice" (Georgiadis et al., 2004) for introduction of this algorithm.
+/// Every vertex is numbered on entry to and exit from a depth-first traversal
+/// of the tree, so that dominance is decided in O(1) time.
+class DomTree {
 public:
-    DomNode(const std::shared_ptr<Vert> &vertex) : vertex(vertex) {}
+    static constexpr auto NONE = UINT32_MAX;
+
+    /// Build dominator tree of vertices reachable from `root` through `Succs`.
+    /// Swap the accessors to build post-dominator tree. Predecessors not
+    /// reachable from root, such as other inputs of a graph, are treated as
+    /// root.
+    template <class Preds = PredsOf, class Succs = SuccsOf, class Vert>
+    static DomTree Build(const std::shared_ptr<Vert> &root);
+
+    /// Whether vertex is in this tree
+    bool Contains(uint32_t id) const {
+        return id < in.size() && in[id] != NONE;
+    }
 
-    bool Dominates(const DomNode &other, bool strict = false) const {
+    /// Whether vertex `a` dominates vertex `b`
+    bool Dominates(uint32_t a, uint32_t b, bool strict = false) const {
+        LOG_ASSERT(Contains(a) && Contains(b));
         if (strict)
-            return (this->in < other.in) && (this->out > other.out);
+            return in[a] < in[b] && out[a] > out[b];
         else
-            return this->in <= other.in && this->out >= other.out;
+            return in[a] <= in[b] && out[a] >= out[b];
     }
 
-    /// Point back to original vertex
-    std::weak_ptr<Vert> vertex;
-    /// Parent in dominator tree
-    std::shared_ptr<DomNode> parent;
-    /// Children in dominator tree
-    std::vector<std::weak_ptr<DomNode>> children;
+    /// ID of root vertex
+    uint32_t Root() const { return root; }
 
-private:
-    /// In and out index for O(1) time dominance decision
-    uint32_t in = 0, out = 0;
-
-    template <class>
-    friend class NodeNumberer;
-};
+    /// Immediate dominator of a vertex. Root is its own immediate dominator.
+    uint32_t IDom(uint32_t id) const { return idom[id]; }
 
-template <class Vert, class Ret, class... Args>
-class DomTreeVisitor {
-public:
-    virtual Ret Visit(const std::shared_ptr<DomNode<Vert>> &node,
-                      Args... args) = 0;
-};
-
-/// Node in depth-first spanning tree
-/// This node is intermediate structure during construction of dominator tree.
-template <class Vert>
-struct DfNode {
-    /// Node pointer is null
-    static constexpr auto NONE = UINT32_MAX;
-
-    /// Point to the actual vertex
-    std::shared_ptr<Vert> vertex;
-    /// Parent of this node in depth-first spanning tree
-    uint32_t parent;
-    /// Semi-dominator
-    uint32_t semi;
-    /// Set of nodes whose semi-dominator is this node
-    std::vector<uint32_t> bucket;
-    /// Immediate dominator
-    uint32_t idom;
-    /// Tree root in the forest
-    uint32_t ancestor;
-    /// Intermediate evaluation result
-    uint32_t best;
-    /// Size of the subtree with this node as root
-    uint32_t size;
-    /// Child of this node
-    uint32_t child;
-};
-
-/// Builder of dominator tree, which implements Lengaur-Tarjan algorithm.
-/// See https://www.cl.cam.ac.uk/~mr10/lengtarj.pdf for introduction of this
-/// algorithm.
-template <class Vert>
-class DomBuilder {
-public:
-    using VertRef = std::shared_ptr<Vert>;
-    using DomNodeRef = std::shared_ptr<DomNode<Vert>>;
-    using VertListFunc = std::function<std::vector<VertRef>(const VertRef &)>;
-
-    DomBuilder(VertListFunc getPreds = std::mem_fn(&Vert::Preds),
-               VertListFunc getSuccs = std::mem_fn(&Vert::Succs))
-        : getPreds(getPreds), getSuccs(getSuccs) {}
-
-    std::vector<DomNodeRef> Build(const VertRef &root);
+    /// Vertices in this tree, in depth-first pre-order of the graph
+    const std::vector<uint32_t> &Verts() const { return verts; }
 
 private:
-    using DfNodeType = DfNode<Vert>;
-
-    uint32_t eval(uint32_t v);
-    void compress(uint32_t v);
-    void link(uint32_t v, uint32_t w);
-
-#define DFNODE_FIELD(name) \
-    uint32_t &name(uint32_t v) { return nodes[v].name; }
-
-    DFNODE_FIELD(parent)
-    DFNODE_FIELD(semi)
-    DFNODE_FIELD(idom)
-    DFNODE_FIELD(ancestor)
-    DFNODE_FIELD(best)
-    DFNODE_FIELD(size)
-    DFNODE_FIELD(child)
-
-#undef DFNODE_FIELD
-
-    VertListFunc getPreds, getSuccs;
-    std::vector<DfNodeType> nodes;
-    std::unordered_map<VertRef, uint32_t> vertIdx;
+    uint32_t root = NONE;
+    std::vector<uint32_t> verts;
+    /// Immediate dominator, entry and exit number of each vertex
+    std::vector<uint32_t> idom, in, out;
 };
 
-template <class Vert>
-class NodeNumberer : public DomTreeVisitor<Vert, Unit> {
-public:
-    Unit Visit(const std::shared_ptr<DomNode<Vert>> &node) override {
-        node->in = number++;
-        for (auto &child : node->children) Visit(child.lock());
-        node->out = number++;
-        return {};
-    }
-
-private:
-    uint32_t number = 0;
-};
-
-template <class Vert>
-std::vector<std::shared_ptr<DomNode<Vert>>> DomBuilder<Vert>::Build(
-    const std::shared_ptr<Vert> &root) {
-    // Find all nodes by depth-first search
-    LOG_ASSERT(root);
-    DfsIter<Vert> end;
-    uint32_t count = 0;
-    for (auto it = DfsIter<Vert>({root}, getSuccs); it != end; ++it) {
-        this->nodes.push_back({
-            *it,               // vertex
-            DfNodeType::NONE,  // parent
-            DfNodeType::NONE,  // semi
-            {},                // bucket
-            DfNodeType::NONE,  // idom
-            DfNodeType::NONE,  // ancestor
-            count,             // best
-            0,                 // size
-            DfNodeType::NONE   // child
-        });
-        vertIdx.insert({*it, count});
-        count++;
-    }
-
-    // Find parent for each child
-    if (nodes.size() <= 1) {
-        LOG(ERROR) << "Graph is trivial. No need to build dominator tree.";
-        return {};
-    }
-    for (auto v = 0u; v < nodes.size(); v++) {
-        semi(v) = v;
-        for (auto &wVert : getSuccs(nodes[v].vertex)) {
-            auto w = vertIdx[wVert];
-            if (semi(w) == DfNodeType::NONE) parent(w) = v;
-        }
-    }
-
-    for (auto w = uint32_t(nodes.size() - 1); w >= 1; w--) {
-        // Compute semi-dominator of each vertex
-        auto p = parent(w);
-        for (auto &vVert : getPreds(nodes[w].vertex)) {
-            auto v = vertIdx[vVert];
-            auto u = eval(v);
-            if (semi(w) > semi(u)) semi(w) = semi(u);
+template <class PredFunc>
+std::vector<uint32_t> SemiNcaIDom(const std::vector<uint32_t> &parent,
+                                  PredFunc forEachPred) {
+    // Compute semi-dominators in reverse pre-order. The forest is linked
+    // without balancing, and paths are compressed with explicit stack.
+    constexpr auto NONE = DomTree::NONE;
+    auto n = uint32_t(parent.size());
+    std::vector<uint32_t> semi(n), label(n), ancestor(n, NONE), path;
+    std::iota(semi.begin(), semi.end(), 0);
+    std::iota(label.begin(), label.end(), 0);
+    auto eval = [&](uint32_t v) {
+        if (ancestor[v] == NONE) return v;
+        path.clear();
+        path.push_back(v);
+        while (ancestor[ancestor[path.back()]] != NONE)
+            path.push_back(ancestor[path.back()]);
+        for (auto i = int64_t(path.size()) - 2; i >= 0; i--) {
+            auto u = path[i], a = ancestor[u];
+            if (semi[label[a]] < semi[label[u]]) label[u] = label[a];
+            ancestor[u] = ancestor[a];
         }
-        AddUnique(nodes[semi(w)].bucket, w);
-        link(p, w);
-
-        // Implicitly define immediate dominators
-        for (auto v : nodes[p].bucket) {
-            auto u = eval(v);
-            idom(v) = semi(u) < semi(v) ? u : p;
-        }
-        nodes[p].bucket.clear();
+        return label[v];
+    };
+    for (auto w = n - 1; w >= 1; w--) {
+        forEachPred(w, [&](uint32_t u) {
+            semi[w] = std::min(semi[w], semi[eval(u)]);
+        });
+        ancestor[w] = parent[w];
     }
 
-    // Explicitly define immediate dominators
-    std::vector<DomNodeRef> results;
-    for (auto &node : nodes)
-        results.push_back(std::make_shared<DomNode<Vert>>(node.vertex));
-    for (auto v = 1u; v < nodes.size(); v++) {
-        if (idom(v) != semi(v)) idom(v) = idom(idom(v));
-        auto d = idom(v);
-        results[v]->parent = results[d];
-        results[d]->children.push_back(results[v]);
+    // Compute immediate dominators as nearest common ancestors in spanning tree
+    std::vector<uint32_t> idom(n, 0);
+    for (auto v = 1u; v < n; v++) {
+        auto d = parent[v];
+        while (d > semi[v]) d = idom[d];
+        idom[v] = d;
     }
-
-    // Number all nodes for O(1) dominance decision
-    NodeNumberer<Vert>().Visit(results[0]);
-
-    return results;
+    return idom;
 }
 
-template <class Vert>
-uint32_t DomBuilder<Vert>::eval(uint32_t v) {
-    if (ancestor(v) == DfNodeType::NONE)
-        return v;
-    else {
-        compress(v);
-        auto b = best(v), a = ancestor(v), ba = best(a);
-        return semi(ba) < semi(b) ? ba : b;
+template <class Preds, class Succs, class Vert>
+DomTree DomTree::Build(const std::shared_ptr<Vert> &root) {
+    // Number vertices in depth-first pre-order, and record their parents in
+    // depth-first spanning tree
+    LOG_ASSERT(root);
+    std::vector<std::shared_ptr<Vert>> nodes;
+    std::vector<uint32_t> parent, num;
+    std::vector<std::pair<std::shared_ptr<Vert>, uint32_t>> stack{{root, 0}};
+    while (!stack.empty()) {
+        auto [vert, par] = std::move(stack.back());
+        stack.pop_back();
+        auto id = vert->id;
+        LOG_ASSERT(id != Vert::NO_ID);
+        if (id >= num.size())
+            num.resize(std::max(size_t(id) + 1, 2 * num.size()), NONE);
+        if (num[id] != NONE) continue;
+        auto v = uint32_t(nodes.size());
+        num[id] = v;
+        parent.push_back(par);
+        auto &succs = Succs::List(*vert);
+        for (auto it = succs.rbegin(); it != succs.rend(); it++)
+            stack.push_back({NbrRef(*it), v});
+        nodes.push_back(std::move(vert));
     }
-}
-
-template <class Vert>
-void DomBuilder<Vert>::compress(uint32_t v) {
-    auto a = ancestor(v);
-    if (ancestor(a) == DfNodeType::NONE) return;
-    compress(a);
-    if (semi(best(a)) < semi(best(v))) best(v) = best(a);
-    ancestor(v) = ancestor(a);
-}
-
-/// Add edge `(v, w)` to the forest
-template <class Vert>
-void DomBuilder<Vert>::link(uint32_t v, uint32_t w) {
-    auto s = w;
-    while (child(s) != DfNodeType::NONE &&
-           semi(best(w)) < semi(best(child(s)))) {
-        // Combine the first two trees in the child chain, making the larger one
-        // the combined root.
-        auto cs = child(s), ss = size(s);
-        auto ccs = child(cs), scs = size(cs);
-        auto sccs = size(ccs);
-        if (ss + sccs >= 2 * scs) {
-            ancestor(cs) = s;
-            child(s) = ccs;
-        } else {
-            size(cs) = ss;
-            ancestor(s) = cs;
-            s = cs;
+    auto n = uint32_t(nodes.size());
+    auto numOf = [&](uint32_t id) {
+        return id < num.size() && num[id] != NONE ? num[id] : 0;
+    };
+
+    // Compute immediate dominators by pre-order numbers
+    auto idomNum = SemiNcaIDom(parent, [&](uint32_t v, auto &&f) {
+        for (auto &pred : Preds::List(*nodes[v])) f(numOf(NbrRef(pred)->id));
+    });
+
+    // Store tree by vertex ID
+    DomTree tree;
+    tree.root = root->id;
+    tree.verts.reserve(n);
+    for (auto &vert : nodes) tree.verts.push_back(vert->id);
+    auto size = *std::max_element(tree.verts.begin(), tree.verts.end()) + 1;
+    tree.idom.assign(size, NONE);
+    tree.in.assign(size, NONE);
+    tree.out.assign(size, NONE);
+    for (auto v = 0u; v < n; v++)
+        tree.idom[tree.verts[v]] = tree.verts[idomNum[v]];
+
+    // Number vertices on entry and exit of depth-first traversal of the tree
+    std::vector<uint32_t> childBegin(n + 1, 0), children(n);
+    for (auto v = 1u; v < n; v++) childBegin[idomNum[v] + 1]++;
+    std::partial_sum(childBegin.begin(), childBegin.end(), childBegin.begin());
+    auto fill = childBegin;
+    for (auto v = 1u; v < n; v++) children[fill[idomNum[v]]++] = v;
+    uint32_t number = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> treeStack{{0, childBegin[0]}};
+    tree.in[tree.root] = number++;
+    while (!treeStack.empty()) {
+        auto &[v, next] = treeStack.back();
+        if (next == childBegin[v + 1]) {
+            tree.out[tree.verts[v]] = number++;
+            treeStack.pop_back();
+            continue;
         }
+        auto c = children[next++];
+        tree.in[tree.verts[c]] = number++;
+        treeStack.push_back({c, childBegin[c]});
     }
 
-    // Combine the two forests giving the combination the child chain of the
-    // smaller forest. The other child chain is then collapsed, giving all its
-    // trees ancestor link to v.
-    best(s) = best(w);
-    if (size(v) < size(w)) std::swap(s, child(v));
-    size(v) += size(w);
-    while (s != DfNodeType::NONE) {
-        ancestor(s) = v;
-        s = child(s);
-    }
+    return tree;
 }
 
-}  // namespace hmcos
\ No newline at end of file
+}  // namespace hmcos
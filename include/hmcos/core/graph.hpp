@@ -2,6 +2,7 @@
 
 #include <hmcos/core/value.hpp>
 #include <hmcos/core/vertex.hpp>
+#include <hmcos/util/op.hpp>
 #include <hmcos/util/util.hpp>
 
 namespace hmcos {
@@ -51,13 +52,18 @@ struct Op : Vertex {
     std::string name;
     /// Type name of this op
     std::string type;
+    /// Kind of this op, resolved from its type once it is created
+    OpKind kind;
     /// Input and output values of this operator
     std::vector<ValueRef> inputs, outputs;
 
     Op(const onnx::NodeProto *node)
-        : name(node->name()), type(node->op_type()) {}
+        : name(node->name()),
+          type(node->op_type()),
+          kind(GetOpKind(node->op_type())) {}
 
-    Op(const Op &other) : name(other.name), type(other.type) {}
+    Op(const Op &other)
+        : name(other.name), type(other.type), kind(other.kind) {}
 
     static constexpr auto classKind = VertexKind::OP;
     VertexKind Kind() const override { return VertexKind::OP; }
@@ -65,6 +71,17 @@ struct Op : Vertex {
 
 using OpRef = std::shared_ptr<Op>;
 
+/// Contiguous range of vertex or value IDs
+struct IdRange {
+    const uint32_t *first, *last;
+
+    const uint32_t *begin() const { return first; }
+    const uint32_t *end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    uint32_t operator[](size_t i) const { return first[i]; }
+};
+
 struct Graph {
     // Name of this graph
     std::string name;
@@ -77,6 +94,13 @@ struct Graph {
     /// All operators in graph
     std::vector<OpRef> ops;
 
+    /// Vertices and values indexed by their IDs
+    /// Ops are numbered first in the order of `ops`, and then inputs and
+    /// outputs. Values are numbered with inputs first, then parameters, and
+    /// then outputs of each op. Pointers are non-owning.
+    std::vector<Vertex *> verts;
+    std::vector<Value *> values;
+
     Graph() = default;
 
     /// Create a graph from ONNX model.
@@ -85,6 +109,24 @@ struct Graph {
     /// Otherwise the constructor will panic.
     Graph(const onnx::ModelProto &model, const std::string &name = "");
 
+    /// Check whether a graph can be built from ONNX model. Return the reason
+    /// why the constructor would panic, or an empty string if it would not.
+    static std::string Check(const onnx::ModelProto &model);
+
+    uint32_t NumVerts() const { return uint32_t(verts.size()); }
+    uint32_t NumValues() const { return uint32_t(values.size()); }
+
+    /// IDs of predecessors and successors of vertex `id`, in the same order as
+    /// `preds` and `succs` of the vertex
+    IdRange PredIds(uint32_t id) const {
+        return {predIdx.data() + predBegin[id],
+                predIdx.data() + predBegin[id + 1]};
+    }
+    IdRange SuccIds(uint32_t id) const {
+        return {succIdx.data() + succBegin[id],
+                succIdx.data() + succBegin[id + 1]};
+    }
+
     /// Clone this graph.
     /// All vertices and values in this graph will be cloned, not
     /// reference-copied.
@@ -100,8 +142,21 @@ struct Graph {
     void Plot(const std::string &dir,
                    const std::string &format = "pdf") const;
 
-    /// Connect vertices according to their def-use relations
+    /// Connect vertices according to their def-use relations, and then index
+    /// the graph
     void ConnectVerts();
+
+    /// Number vertices and values, and build adjacency arrays of vertices.
+    /// Must be called again if vertices are added or edges are changed.
+    void Index();
+
+private:
+    /// Adjacency of vertices in compressed sparse row format
+    /// Predecessors of vertex `i` are `predIdx[predBegin[i]]` to
+    /// `predIdx[predBegin[i + 1] - 1]`. Successors are stored in the same way.
+    /// This is a read-only index kept in addition to edge lists of vertices,
+    /// so it costs extra memory rather than replacing them.
+    std::vector<uint32_t> predBegin, predIdx, succBegin, succIdx;
 };
 
 class RpoVertRange : public VertRange<Vertex, RpoIter<Vertex>> {
@@ -152,8 +207,13 @@ protected:
     std::unordered_map<VertexRef, Ret> memo;
 };
 
+/// Clone vertices and values
+/// All ancestors of a vertex are cloned before it, in post-order with explicit
+/// stack, so cloning methods do not recurse.
 class VertexCloner : public VertexVisitor<VertexRef> {
 public:
+    VertexRef Visit(const VertexRef &vert) override;
+
     VertexRef VisitInput(const InputRef &input) override;
     VertexRef VisitOutput(const OutputRef &output) override;
     VertexRef VisitOp(const OpRef &op) override;
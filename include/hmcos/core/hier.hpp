@@ -13,21 +13,11 @@ enum class HierKind {
 };
 
 struct HierVertex : public VertexBase<HierVertex> {
-    /// Node of this vertex in dominator and post-dominator tree
-    std::shared_ptr<DomNode<HierVertex>> dom, postDom;
     /// Keep record of predecessors and successors when this vertex is not
     /// grouped
     std::vector<std::weak_ptr<HierVertex>> prevPreds;
     std::vector<std::shared_ptr<HierVertex>> prevSuccs;
 
-    bool Dominates(const HierVertex &other, bool strict = false) const {
-        return this->dom->Dominates(*other.dom, strict);
-    }
-
-    bool PostDominates(const HierVertex &other, bool strict = false) const {
-        return this->postDom->Dominates(*other.postDom, strict);
-    }
-
     void BackupEdges() {
         prevPreds = preds;
         prevSuccs = succs;
@@ -41,7 +31,6 @@ struct HierVertex : public VertexBase<HierVertex> {
 
 using HierVertRef = std::shared_ptr<HierVertex>;
 using HierVertWeakRef = std::weak_ptr<HierVertex>;
-using HierDomNodeRef = std::shared_ptr<DomNode<HierVertex>>;
 
 /// Equivalent to `Input`, but appear in a hierarchical graph.
 struct HierInput : public HierVertex {
@@ -163,9 +152,19 @@ struct HierGraph {
     std::vector<HierOutputRef> outputs;
     /// Maps op to sequence that contains it
     std::unordered_map<OpRef, SequenceRef> opToSeq;
+    /// Dominator and post-dominator tree of sequences, built before any group
+    /// is made. Ungrouping restores the edges between sequences, so the trees
+    /// stay valid as groups are made and removed. They can also be shared by
+    /// hierarchical graphs built from the same graph with the same passes.
+    std::shared_ptr<const DomTree> dom, postDom;
 
     explicit HierGraph(const Graph &graph);
 
+    /// Allocate an ID for a new vertex
+    /// Vertices created from the original graph share IDs with the vertices
+    /// they are created from. New vertices are numbered after them.
+    uint32_t NewId() { return nextId++; }
+
     /// Plot all levels of structures in this hierarchical graph
     void PlotAll(const std::string &dir, const std::string &name,
                  const std::string &format = "pdf");
@@ -181,6 +180,9 @@ struct HierGraph {
     /// Plot post-dominator tree of this hierarchical graph
     void PlotPostDom(const std::string &dir, const std::string &name,
                      const std::string &format = "pdf");
+
+private:
+    uint32_t nextId;
 };
 
 class RpoHierRange : public VertRange<HierVertex, RpoIter<HierVertex>> {
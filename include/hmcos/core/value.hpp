@@ -77,6 +77,8 @@ struct Value {
     /// this value. An op may appear multiple times if it uses this value more
     /// than once.
     std::vector<std::weak_ptr<Op>> uses;
+    /// Index of this value in its graph. Not copied when cloning.
+    uint32_t id = UINT32_MAX;
 
     static Value CreateInput(const onnx::ValueInfoProto &info);
     static Value CreateParam(const onnx::TensorProto &tensor);
@@ -8,6 +8,12 @@ struct VertexBase {
     using VertRef = std::shared_ptr<Vert>;
     using VertWeakRef = std::weak_ptr<Vert>;
 
+    static constexpr uint32_t NO_ID = UINT32_MAX;
+
+    /// Index of this vertex in its graph, or `NO_ID` if the graph is not
+    /// indexed
+    uint32_t id = NO_ID;
+
     /// Predecessor list of vertex
     /// All elements in predecessor or successor list must be distinct.
     /// (Multi-edges are not allowed)
@@ -71,6 +77,109 @@ struct VertexBase {
     }
 };
 
+/// Neighbour accessors of vertices
+/// `List` returns the predecessor or successor list of a vertex by reference.
+/// Traversals take accessors as template parameters, so that neighbour access
+/// is inlined and no list is copied.
+struct PredsOf {
+    template <class Vert>
+    static auto &List(const Vert &vert) {
+        return vert.preds;
+    }
+};
+
+struct SuccsOf {
+    template <class Vert>
+    static auto &List(const Vert &vert) {
+        return vert.succs;
+    }
+};
+
+/// Strong reference to an element in neighbour list
+template <class Vert>
+inline const std::shared_ptr<Vert> &NbrRef(const std::shared_ptr<Vert> &vert) {
+    return vert;
+}
+
+template <class Vert>
+inline std::shared_ptr<Vert> NbrRef(const std::weak_ptr<Vert> &vert) {
+    return vert.lock();
+}
+
+/// Set of vertices, stored as a bitmap over vertex IDs
+/// The bitmap grows on demand, so the number of vertices need not be known in
+/// advance.
+class VertSet {
+public:
+    template <class Vert>
+    bool Contains(const Vert &vert) const {
+        return vert.id < bits.size() && bits[vert.id];
+    }
+
+    /// Insert a vertex. Return whether it was not in the set.
+    template <class Vert>
+    bool Insert(const Vert &vert) {
+        LOG_ASSERT(vert.id != Vert::NO_ID);
+        if (vert.id >= bits.size())
+            bits.resize(std::max(size_t(vert.id) + 1, 2 * bits.size()));
+        if (bits[vert.id]) return false;
+        bits[vert.id] = true;
+        return true;
+    }
+
+private:
+    std::vector<bool> bits;
+};
+
+/// Visit vertices reachable from `roots` in depth-first pre-order
+/// `visit` is called on a vertex before its neighbours are read, so it may
+/// change neighbours of that vertex.
+template <class Nbrs = SuccsOf, class Vert, class Visit>
+inline void PreorderTraverse(const std::vector<std::shared_ptr<Vert>> &roots,
+                             Visit visit) {
+    VertSet visited;
+    std::vector<std::shared_ptr<Vert>> stack(roots.rbegin(), roots.rend());
+    while (!stack.empty()) {
+        auto vert = std::move(stack.back());
+        stack.pop_back();
+        if (!visited.Insert(*vert)) continue;
+        visit(vert);
+        auto &nbrs = Nbrs::List(*vert);
+        for (auto it = nbrs.rbegin(); it != nbrs.rend(); it++)
+            stack.push_back(NbrRef(*it));
+    }
+}
+
+/// Visit vertices reachable from `root` in depth-first post-order
+/// `enter` is called when a vertex is reached for the first time, and returns
+/// whether its neighbours should be traversed. If so, `leave` is called on it
+/// after all of its neighbours are left.
+template <class Nbrs = PredsOf, class Vert, class Enter, class Leave>
+inline void PostorderTraverse(const std::shared_ptr<Vert> &root, Enter enter,
+                              Leave leave) {
+    struct Frame {
+        std::shared_ptr<Vert> vert;
+        uint32_t next;
+    };
+    VertSet visited;
+    visited.Insert(*root);
+    if (!enter(root)) return;
+    std::vector<Frame> stack{{root, 0}};
+    while (!stack.empty()) {
+        auto &frame = stack.back();
+        auto &nbrs = Nbrs::List(*frame.vert);
+        if (frame.next == nbrs.size()) {
+            auto vert = std::move(frame.vert);
+            stack.pop_back();
+            leave(vert);
+            continue;
+        }
+        auto nbr = NbrRef(nbrs[frame.next++]);
+        if (visited.Insert(*nbr) && enter(nbr))
+            stack.push_back({std::move(nbr), 0});
+    }
+}
+
 template <class Vert, class Iter>
 class VertIter {
 public:
@@ -84,8 +193,8 @@ public:
         while (!iter->End()) {
             auto result = iter->Loop();
             if (result) {
-                this->next = result;
-                this->traversed.insert(result);
+                this->traversed.Insert(*result);
+                this->next = std::move(result);
                 return;
             }
         }
@@ -103,69 +212,80 @@ public:
     }
 
 protected:
-    bool hasTraversed(const VertRef &v) const { return Contains(traversed, v); }
+    bool hasTraversed(const VertRef &v) const { return traversed.Contains(*v); }
 
 private:
     VertRef next;
-    std::unordered_set<VertRef> traversed;
+    VertSet traversed;
 };
 
-template <class Vert>
-class DfsIter : public VertIter<Vert, DfsIter<Vert>> {
+template <class Vert, class Nbrs = SuccsOf>
+class DfsIter : public VertIter<Vert, DfsIter<Vert, Nbrs>> {
 public:
     using VertRef = std::shared_ptr<Vert>;
-    using VertListFunc = std::function<std::vector<VertRef>(const VertRef &)>;
 
     DfsIter() = default;
-    DfsIter(const std::vector<VertRef> &inputs,
-            VertListFunc getSuccs = std::mem_fn(&Vert::Succs));
+    DfsIter(const std::vector<VertRef> &inputs)
+        : stack(inputs.rbegin(), inputs.rend()) {
+        this->operator++();
+    }
 
     bool End() const { return stack.empty(); }
-    VertRef Loop();
-
-private:
-    VertListFunc getSuccs;
-    std::vector<VertRef> stack;
-};
 
-template <class Vert>
-DfsIter<Vert>::DfsIter(const std::vector<VertRef> &inputs,
-                       VertListFunc getSuccs)
-    : getSuccs(getSuccs) {
-    for (auto it = inputs.rbegin(); it != inputs.rend(); it++)
-        stack.push_back(*it);
-    this->operator++();
-}
+    VertRef Loop() {
+        // Pop one vertex
+        auto vertex = std::move(stack.back());
+        stack.pop_back();
 
-template <class Vert>
-std::shared_ptr<Vert> DfsIter<Vert>::Loop() {
-    // Pop one vertex
-    auto vertex = stack.back();
-    stack.pop_back();
+        // Skip travered vertex
+        if (this->hasTraversed(vertex)) return nullptr;
 
-    // Skip travered vertex
-    if (this->hasTraversed(vertex)) return nullptr;
+        // Add successors to stack
+        auto &succs = Nbrs::List(*vertex);
+        for (auto it = succs.rbegin(); it != succs.rend(); it++)
+            stack.push_back(NbrRef(*it));
 
-    // Add successors to stack
-    auto succs = getSuccs(vertex);
-    for (auto it = succs.rbegin(); it != succs.rend(); it++)
-        stack.push_back(*it);
+        return vertex;
+    }
 
-    return vertex;
-}
+private:
+    std::vector<VertRef> stack;
+};
 
-template <class Vert>
-class RpoIter : public VertIter<Vert, RpoIter<Vert>> {
+template <class Vert, class Nbrs = PredsOf>
+class RpoIter : public VertIter<Vert, RpoIter<Vert, Nbrs>> {
 public:
     using VertRef = std::shared_ptr<Vert>;
-    using VertListFunc = std::function<std::vector<VertRef>(const VertRef &)>;
 
     RpoIter() = default;
-    RpoIter(const std::vector<VertRef> &outputs,
-            VertListFunc getPreds = std::mem_fn(&Vert::Preds));
+    RpoIter(const std::vector<VertRef> &outputs) {
+        stack.reserve(outputs.size());
+        for (auto it = outputs.rbegin(); it != outputs.rend(); it++)
+            stack.push_back({*it, false});
+        this->operator++();
+    }
 
     bool End() const { return stack.empty(); }
-    VertRef Loop();
+
+    VertRef Loop() {
+        // Pop one vertex
+        auto [vertex, visited] = std::move(stack.back());
+        stack.pop_back();
+
+        // Skip if this vertex is traversed before
+        if (this->hasTraversed(vertex)) return nullptr;
+
+        // Apply function to vertex if it has been visited
+        if (visited) return vertex;
+
+        // Otherwise add predecessors to stack
+        auto &preds = Nbrs::List(*vertex);
+        stack.push_back({vertex, true});
+        for (auto it = preds.rbegin(); it != preds.rend(); it++)
+            stack.push_back({NbrRef(*it), false});
+
+        return nullptr;
+    }
 
 private:
     struct StackRecord {
@@ -173,40 +293,9 @@ private:
         bool visited;
     };
 
-    VertListFunc getPreds;
     std::vector<StackRecord> stack;
 };
 
-template <class Vert>
-RpoIter<Vert>::RpoIter(const std::vector<std::shared_ptr<Vert>> &outputs,
-                       VertListFunc getPreds)
-    : getPreds(getPreds) {
-    for (auto it = outputs.rbegin(); it != outputs.rend(); it++)
-        stack.push_back({*it, false});
-    this->operator++();
-}
-
-template <class Vert>
-std::shared_ptr<Vert> RpoIter<Vert>::Loop() {
-    // Pop one vertex
-    auto [vertex, visited] = stack.back();
-    stack.pop_back();
-
-    // Skip if this vertex is traversed before
-    if (this->hasTraversed(vertex)) return nullptr;
-
-    // Apply function to vertex if it has been visited
-    if (visited) return vertex;
-
-    // Otherwise add predecessors to stack
-    stack.push_back({vertex, true});
-    auto preds = getPreds(vertex);
-    for (auto it = preds.rbegin(); it != preds.rend(); it++)
-        stack.push_back({*it, false});
-
-    return nullptr;
-}
-
 template <class Vert, class Iter>
 class VertRange {
 public:
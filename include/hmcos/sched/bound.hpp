@@ -0,0 +1,27 @@
+#pragma once
+
+#include <hmcos/core/graph.hpp>
+
+namespace hmcos {
+
+/// Bounds of peak memory of all schedules of a graph
+struct PeakBound {
+    /// Certified lower bound. No schedule has a lower peak.
+    uint64_t lower = 0;
+    /// Peak of reverse post-order schedule, which is achievable
+    uint64_t upper = 0;
+
+    /// Relative gap between `peak` of a schedule and the lower bound
+    double Gap(uint64_t peak) const {
+        return peak == 0 ? 0 : double(peak - lower) / double(peak);
+    }
+};
+
+/// Quickly compute bounds of peak memory of a graph, without scheduling it.
+/// The lower bound is the largest of graph input size, op footprints, and
+/// memory at ops that every path of the graph passes through. At such an op,
+/// every other op is either its ancestor or descendant, so the values alive
+/// there are the same in all schedules.
+PeakBound ComputePeakBound(const Graph &graph);
+
+}  // namespace hmcos
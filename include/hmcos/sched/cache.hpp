@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hmcos {
+
+/// Key of a group schedule, which is a 128-bit structural hash of the group and
+/// its kill context
+struct GroupCacheKey {
+    uint64_t hi = 0, lo = 0;
+
+    bool operator==(const GroupCacheKey &other) const {
+        return this->hi == other.hi && this->lo == other.lo;
+    }
+};
+
+/// Incrementally compute `GroupCacheKey`. The result only depends on the data
+/// added, so it is stable across runs and processes.
+class GroupKeyHasher {
+public:
+    void Add(uint64_t data) {
+        key.hi = mix(key.hi ^ data, 0x9e3779b97f4a7c15ull);
+        key.lo = mix(key.lo + data, 0xc2b2ae3d27d4eb4full);
+    }
+
+    void Add(const std::string &str) {
+        Add(str.size());
+        for (auto c : str) Add(uint64_t(uint8_t(c)));
+    }
+
+    GroupCacheKey Key() const { return key; }
+
+private:
+    static uint64_t mix(uint64_t x, uint64_t mul) {
+        x *= mul;
+        x ^= x >> 31;
+        x *= 0xbf58476d1ce4e5b9ull;
+        return x ^ (x >> 29);
+    }
+
+    GroupCacheKey key;
+};
+
+/// Schedule of a group stored in cache
+struct GroupCacheEntry {
+    /// Peak and latest memory of this schedule
+    int64_t peak, latest;
+    /// Scheduled ops, as indices of ops in group
+    std::vector<uint32_t> ops;
+};
+
+}  // namespace hmcos
+
+namespace std {
+
+template <>
+struct hash<hmcos::GroupCacheKey> {
+    size_t operator()(const hmcos::GroupCacheKey &key) const { return key.lo; }
+};
+
+}  // namespace std
+
+namespace hmcos {
+
+/// Cache of group schedules, which is optionally persistent
+/// All entries in the file are loaded when the cache is opened, and new entries
+/// are appended to the file once inserted, so that they are visible to later
+/// runs and other processes. The cache can be shared by multiple threads.
+/// Each record is appended with one write under an exclusive file lock, and
+/// carries its length and checksum. Records that are incomplete or corrupted,
+/// such as one left by a killed process, are skipped when loading, so the file
+/// can be shared by processes running at the same time.
+class GroupCache {
+public:
+    /// Create cache in memory only
+    GroupCache() = default;
+
+    /// Open cache file at `path`. The file is created if it does not exist.
+    explicit GroupCache(const std::string &path);
+    ~GroupCache();
+
+    GroupCache(const GroupCache &) = delete;
+    GroupCache &operator=(const GroupCache &) = delete;
+
+    /// Find schedule of `key`
+    std::optional<GroupCacheEntry> Find(const GroupCacheKey &key);
+
+    /// Count a lookup as hit or miss. A found entry is only a hit after it is
+    /// checked by the caller.
+    void Count(bool hit) { (hit ? hits : misses)++; }
+
+    /// Insert schedule of `key` and append it to file
+    void Insert(const GroupCacheKey &key, const GroupCacheEntry &entry);
+
+    /// Number of entries in cache
+    size_t Size();
+
+    /// Number of lookups that find or do not find schedule
+    size_t Hits() const { return hits; }
+    size_t Misses() const { return misses; }
+
+private:
+    std::unordered_map<GroupCacheKey, GroupCacheEntry> entries;
+#if defined(WIN32)
+    /// Handle of cache file, or null if cache is in memory only
+    void *file = nullptr;
+#else
+    /// Descriptor of cache file, or -1 if cache is in memory only
+    int file = -1;
+#endif
+    std::mutex mutex;
+    std::atomic<size_t> hits{0}, misses{0};
+};
+
+}  // namespace hmcos
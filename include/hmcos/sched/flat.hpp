@@ -0,0 +1,75 @@
+#pragma once
+
+#include <hmcos/sched/life.hpp>
+
+namespace hmcos {
+
+/// Graph compiled into flat arrays, where ops and values are referred to by
+/// dense indices
+/// Ops are numbered in the order of `Graph::ops`. Values are numbered with
+/// graph inputs first, and then outputs of each op. Parameters are not
+/// included. Estimators that evaluate many schedules of one graph should
+/// compile it once and work on these arrays.
+struct FlatGraph {
+    static constexpr uint32_t NO_OP = UINT32_MAX;
+
+    /// Ops and their kinds
+    std::vector<OpRef> ops;
+    std::vector<OpKind> kinds;
+    /// Inputs of op `i` are `inputs[inBegin[i]]` to `inputs[inBegin[i + 1] - 1]`
+    /// in the order of `Op::inputs`, with parameters skipped. Outputs are
+    /// stored in the same way.
+    std::vector<uint32_t> inBegin, inputs, outBegin, outputs;
+    /// Total size of outputs of each op
+    std::vector<uint64_t> outSize;
+    /// Offset in inputs of each op that its output can overlap, or
+    /// `OVERLAP_FAILED`
+    std::vector<uint32_t> overlap;
+
+    /// Values, their sizes and defining ops
+    std::vector<ValueRef> values;
+    std::vector<uint64_t> valSize;
+    std::vector<uint32_t> defOp;
+    /// Number of uses of each value before any op is scheduled
+    std::vector<uint32_t> useCnt;
+    /// Graph inputs are the first `nInputs` values, whose total size is
+    /// `inputSize`
+    uint32_t nInputs = 0;
+    uint64_t inputSize = 0;
+    /// Graph outputs
+    std::vector<uint32_t> graphOutputs;
+
+    explicit FlatGraph(const Graph &graph);
+
+    uint32_t NumOps() const { return uint32_t(ops.size()); }
+    uint32_t NumValues() const { return uint32_t(values.size()); }
+
+    uint32_t OpIndex(const OpRef &op) const { return opIdx.at(op); }
+
+    /// Convert op sequence to indices, and back
+    std::vector<uint32_t> Compile(const std::vector<OpRef> &seq) const;
+    std::vector<OpRef> Decompile(const std::vector<uint32_t> &seq) const;
+
+    /// Value that the output of op `i` can overlap, or `OVERLAP_FAILED`
+    uint32_t OverlapValue(uint32_t i) const {
+        return overlap[i] == OVERLAP_FAILED ? OVERLAP_FAILED
+                                            : inputs[inBegin[i] + overlap[i]];
+    }
+
+    /// Same as `EstimatePeak` and `ComputeLifetime`, on compiled sequences
+    uint64_t EstimatePeak(const std::vector<uint32_t> &seq) const;
+    LifetimeStat ComputeLifetime(const std::vector<uint32_t> &seq) const;
+
+    /// Same as above, but the op sequence is compiled first
+    uint64_t EstimatePeak(const std::vector<OpRef> &seq) const {
+        return EstimatePeak(Compile(seq));
+    }
+    LifetimeStat ComputeLifetime(const std::vector<OpRef> &seq) const {
+        return ComputeLifetime(Compile(seq));
+    }
+
+private:
+    std::unordered_map<OpRef, uint32_t> opIdx;
+};
+
+}  // namespace hmcos
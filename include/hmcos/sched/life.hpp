@@ -96,12 +96,19 @@ inline SizeRange LifetimeStat::SizeRange() const { return {*this}; }
 uint32_t OverlapInput(const OpRef &op);
 static constexpr auto OVERLAP_FAILED = UINT32_MAX;
 
+/// Memory footprint of an op, which is a lower bound of memory usage when the
+/// op is executed. Input values must all be alive, and outputs are also
+/// allocated unless one of them can overlap an input.
+int64_t OpFootprint(const OpRef &op);
+
 /// Compute lifetime statistics of a complete op sequence of a graph.
+/// Callers that evaluate more than one sequence of a graph should use
+/// `FlatGraph` instead, which compiles the graph once.
 LifetimeStat ComputeLifetime(const std::vector<OpRef> &opSeq,
                              const Graph &graph);
 
 /// Estimate peak memory usage of an op sequence. This sequence does not need to
-/// contain all the ops in the graph.
+/// contain all the ops in the graph. See `FlatGraph` for repeated estimation.
 uint64_t EstimatePeak(const std::vector<OpRef> &seq,
                       const std::vector<InputRef> &inputs);
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <hmcos/sched/life.hpp>
+#include <map>
+#include <set>
 
 namespace hmcos {
 
@@ -58,17 +60,18 @@ inline bool CmpByOffset(const Step &lhs, const Step &rhs) {
 }
 
 /// Contains rectangular items
+/// Steps form a skyline ordered by time. An ordered set of (offset, begin)
+/// pairs locates the lowest step, so that each operation takes logarithmic
+/// time.
 class Container {
 public:
     Container(int32_t begin, int32_t end)
         : tBegin(begin), tEnd(end), maxHeight(0) {
-        steps.push_back({begin, end - begin, 0});
+        insertStep({begin, end - begin, 0});
     }
 
-    template <class Cmp>
-    const Step &FindMinBy(Cmp cmp) const {
-        return MinElem(steps, cmp);
-    }
+    /// Step with lowest offset. Ties are broken by beginning time.
+    const Step &Lowest() const { return steps.at(lowest.begin()->second); }
 
     uint64_t GetMaxHeight() const { return maxHeight; }
 
@@ -81,33 +84,113 @@ public:
     /// Print steps in container
     void Print() const {
         fmt::print("Steps: \n");
-        for (auto &s : steps) fmt::print("{}\n", s.Format());
+        for (auto &[_, s] : steps) fmt::print("{}\n", s.Format());
         fmt::print("\n");
     }
 
 private:
-    /// Find index of the step at given time
-    int32_t findStepAt(int32_t time) const;
-    /// Try a number of times to merge a step with its next
-    void tryMerge(size_t beginIdx, uint32_t nTrial);
+    using StepIter = std::map<int32_t, Step>::iterator;
+
+    /// Find the step at given time
+    StepIter findStepAt(int32_t time);
+    /// Insert or erase a step, keeping the heap consistent
+    StepIter insertStep(const Step &step);
+    void eraseStep(StepIter it);
+    /// Merge a step with its neighbors that have the same offset
+    void mergeAround(StepIter it);
 
     /// Temporal range of this container
     int32_t tBegin, tEnd;
     /// Maximal height of this container
     uint64_t maxHeight;
-    /// Steps in this container, sorted by time in increasing order
-    std::vector<Step> steps;
+    /// Steps in this container, indexed by beginning time
+    std::map<int32_t, Step> steps;
+    /// Offsets and beginning times of all steps
+    std::set<std::pair<uint64_t, int32_t>> lowest;
 };
 
-template <class Elem, class Pred, class Cmp>
-inline auto MinPosWithConstr(const std::vector<Elem> &vec, Pred pred, Cmp cmp) {
-    std::optional<typename std::vector<Elem>::const_iterator> minPos;
-    for (auto it = vec.begin(); it != vec.end(); it++) {
-        if (!pred(*it)) continue;
-        if (!minPos.has_value() || cmp(*it, *minPos.value())) minPos = it;
-    }
-    return minPos;
-}
+/// Index of unplaced memory blocks for best-fit queries
+/// This is a range tree over generation time of blocks, whose nodes keep
+/// blocks sorted by kill time. Each node also has a segment tree that keeps
+/// the best fit of its unplaced blocks. Query and removal take O(log^2 n).
+class BlockIndex {
+public:
+    static constexpr auto NONE = UINT32_MAX;
+
+    explicit BlockIndex(const std::vector<MemoryDesc> &descs);
+
+    /// Find index of the best fit block whose lifetime is in [begin, end),
+    /// or `NONE` if no such block is unplaced. Blocks are compared with
+    /// `CmpByLengthInv`, and then by their indices.
+    uint32_t BestFit(int32_t begin, int32_t end) const;
+
+    /// Mark a block as placed
+    void Remove(uint32_t idx);
+
+private:
+    struct Node {
+        /// Kill times and indices of blocks, in increasing order
+        std::vector<std::pair<int32_t, uint32_t>> kills;
+        /// Segment tree of best fit blocks over `kills`
+        std::vector<uint32_t> best;
+    };
+
+    uint32_t pick(uint32_t lhs, uint32_t rhs) const;
+
+    const std::vector<MemoryDesc> &descs;
+    /// Generation times of blocks at leaves, in increasing order
+    std::vector<int32_t> gens;
+    /// Maps block indices to leaves
+    std::vector<uint32_t> leafOf;
+    std::vector<Node> nodes;
+};
+
+/// Free space between allocated blocks in a linear address space
+/// Finite gaps are kept in a treap ordered by offset, where each node also
+/// keeps the longest gap in its subtree. Space above all blocks is one
+/// unbounded gap. Allocation and freeing take O(log n) expected time.
+class GapIndex {
+public:
+    GapIndex() : nodes(1, Node{0, 0, 0, 0, NIL, NIL}) {}
+
+    /// Allocate `size` bytes at the lowest offset where they fit. Return the
+    /// offset.
+    uint64_t Allocate(uint64_t size);
+
+    /// Free an allocated range, merging it with adjacent gaps
+    void Free(uint64_t offset, uint64_t size);
+
+    /// End of the highest allocated block
+    uint64_t Top() const { return top; }
+
+private:
+    static constexpr uint32_t NIL = 0;
+
+    struct Node {
+        uint64_t offset, size, maxSize;
+        uint32_t prio, left, right;
+    };
+
+    void update(uint32_t t);
+    /// Split treap into gaps with offsets lower than `offset` and the rest
+    std::pair<uint32_t, uint32_t> split(uint32_t t, uint64_t offset);
+    uint32_t merge(uint32_t lhs, uint32_t rhs);
+    void insert(uint64_t offset, uint64_t size);
+    void erase(uint64_t offset);
+    /// Gap with highest offset lower than `offset`, or `NIL`
+    uint32_t lower(uint64_t offset) const;
+    /// Gap at exactly `offset`, or `NIL`
+    uint32_t find(uint64_t offset) const;
+
+    /// Nodes of treap. Node 0 is the null node, whose `maxSize` is zero.
+    std::vector<Node> nodes;
+    /// Nodes that are erased and can be reused
+    std::vector<uint32_t> freeNodes;
+    uint32_t root = NIL;
+    uint64_t top = 0;
+    /// State of random priorities, fixed so that plans are reproducible
+    uint32_t seed = 0x2545f491;
+};
 
 struct MemoryPlan {
     /// Peak memory footprint
@@ -129,4 +212,36 @@ struct MemoryPlan {
 /// Implement best-fit heuristic by Sekiyama et al.
 MemoryPlan BestFit(const LifetimeStat &stat);
 
+/// Strategy of memory planning
+enum class PlanMethod {
+    /// Best-fit heuristic by Sekiyama et al.
+    BEST_FIT,
+    /// Place larger blocks first, each in the tightest gap among placed blocks
+    /// that overlap it in time
+    GREEDY_BY_SIZE,
+    /// Visit time steps in decreasing order of total size of alive blocks, and
+    /// place blocks alive at each step as in `GREEDY_BY_SIZE`
+    GREEDY_BY_BREADTH,
+    /// Place blocks in order of generation, each at the lowest offset where it
+    /// fits among blocks that are still alive. Gaps are indexed with
+    /// `GapIndex`, so planning takes O(n log n) time. Unlike
+    /// `tflite::SimpleMemoryArena`, which takes the tightest gap, the first gap
+    /// that fits is taken.
+    FIRST_FIT,
+    /// Run all strategies above in parallel and take the plan with the lowest
+    /// peak
+    PORTFOLIO,
+};
+
+/// Options of memory planning
+struct PlanOptions {
+    PlanMethod method = PlanMethod::PORTFOLIO;
+    /// Alignment of memory offsets in bytes. Sizes of blocks are rounded up to
+    /// multiples of it.
+    uint64_t alignment = 1;
+};
+
+/// Plan memory offsets of values with given strategy
+MemoryPlan PlanMemory(const LifetimeStat &stat, const PlanOptions &opts = {});
+
 };  // namespace hmcos
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <chrono>
 #include <hmcos/core/hier.hpp>
+#include <hmcos/sched/cache.hpp>
 #include <random>
 
 namespace hmcos {
@@ -9,6 +11,87 @@ void PlotSchedule(const std::vector<OpRef> &sched, const Graph &graph,
                   const std::string &dir, const std::string &name,
                   const std::string &format = "pdf");
 
+/// Options of DP-based schedulers
+struct SchedOptions {
+    /// Number of threads used to expand each DP layer and to sample schedules
+    /// of groups. Scheduling result does not depend on this number.
+    size_t nThreads = 1;
+    /// Maximal number of partial schedules kept in each DP layer. When there
+    /// are more, only those with lower peak and then lower latest memory are
+    /// kept, and the result is no longer guaranteed to be optimal. Zero means
+    /// no limit.
+    size_t beamWidth = 0;
+    /// Maximal estimated size in bytes of partial schedules kept in each DP
+    /// layer. It limits the layer in the same way as `beamWidth`. Only the
+    /// last vertex schedule of each partial schedule is counted, since earlier
+    /// ones are shared with other partial schedules and previous layers. Zero
+    /// means no limit.
+    size_t maxLayerBytes = 0;
+    /// Directory where DP layers of groups are spilled to. Layers are kept in
+    /// memory if it is empty. Spilled layers are expanded by one thread, and
+    /// beam limits do not apply to them.
+    std::string spillDir;
+    /// Whether hierarchical scheduling tries ungrouping each group related to
+    /// the peak alone, besides ungrouping all of them. Each alternative is
+    /// scheduled on its own thread, and the one with lowest peak is kept.
+    bool speculativeUngroup = false;
+    /// Seed of random schedules sampled by Serenity scheduling. Each sample
+    /// draws from its own stream derived from this seed, so sampled budgets
+    /// are the same for any `nThreads`.
+    uint64_t sampleSeed = 0;
+    /// Serenity scheduling stops sampling a group once the lowest sampled peak
+    /// is not improved for this number of samples. Zero means all samples are
+    /// drawn.
+    size_t samplePatience = 0;
+    /// Persistent cache of group schedules shared with other runs. Groups whose
+    /// isomorphic group is found in cache are not scheduled again. If it is
+    /// null, a cache in memory is used in each run.
+    GroupCache *groupCache = nullptr;
+    /// Time point when hierarchical scheduling stops and returns the best
+    /// schedule found so far
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    /// Whether progress bars of scheduling are printed to standard output
+    bool displayProgress = true;
+};
+
+/// Statistics of hierarchical scheduling
+struct HierSchedStat {
+    /// Whether scheduling stops because no more group can be ungrouped, rather
+    /// than the deadline is reached
+    bool converged = false;
+    /// Number of iterations whose schedule may not be optimal because partial
+    /// schedules are dropped by beam limit
+    size_t nTruncated = 0;
+    /// Elapsed time of each iteration. Its size is the number of iterations.
+    std::vector<std::chrono::steady_clock::duration> iterTimes;
+};
+
+/// Strategy of local search in schedule refinement
+enum class RefineMethod {
+    /// Accept worse moves with probability decreasing over time
+    ANNEALING,
+    /// Take the best of sampled moves, without moving recently moved ops
+    TABU,
+};
+
+/// Options of schedule refinement
+struct RefineOptions {
+    RefineMethod method = RefineMethod::ANNEALING;
+    /// Time spent on refinement
+    std::chrono::steady_clock::duration timeLimit = std::chrono::seconds(1);
+    /// Maximal number of moves evaluated. Zero means no limit.
+    size_t maxMoves = 0;
+    /// Seed of random moves
+    uint64_t seed = 0;
+    /// Initial temperature of annealing, relative to peak of input schedule
+    double initTemp = 0.01;
+    /// Number of iterations that a moved op is not moved again in tabu search
+    size_t tabuTenure = 16;
+    /// Number of moves sampled in each iteration of tabu search
+    size_t tabuSamples = 32;
+};
+
 /// Randomly sample a schedule of the computation graph
 std::vector<OpRef> RandomSample(const Graph &graph, std::mt19937 &rng);
 
@@ -16,10 +99,29 @@ std::vector<OpRef> RandomSample(const Graph &graph, std::mt19937 &rng);
 std::vector<OpRef> ReversePostOrder(const Graph &graph);
 
 /// Use iterative hierarchical scheduling algorithm of HMCOS
-std::vector<OpRef> HierarchicalSchedule(const Graph &graph);
+std::vector<OpRef> HierarchicalSchedule(const Graph &graph,
+                                        const SchedOptions &opts = {},
+                                        HierSchedStat *schedStat = nullptr);
 
 /// Serenity-style scheduling for networks with sequentially-connected cells
 std::vector<OpRef> SerenitySchedule(const Graph &graph, bool joinOps,
-                                    bool trySimple, size_t nSamples);
+                                    bool trySimple, size_t nSamples,
+                                    const SchedOptions &opts = {});
+
+/// Exact branch-and-bound scheduling over topological orders of ops
+/// Budget of peak is deepened from a lower bound until a schedule is found, so
+/// the result is optimal unless deadline in `opts` is reached. In that case the
+/// reverse post-order schedule is returned. `proved` is set to whether the
+/// result is proved optimal with respect to peak given by `EstimatePeak`.
+std::vector<OpRef> BranchAndBoundSchedule(const Graph &graph,
+                                          const SchedOptions &opts = {},
+                                          bool *proved = nullptr);
+
+/// Refine a schedule with local search. Each move places an op at another
+/// valid position, and its peak is evaluated incrementally. The schedule with
+/// lowest peak found is returned, which is never worse than `sched`.
+std::vector<OpRef> RefineSchedule(const Graph &graph,
+                                  const std::vector<OpRef> &sched,
+                                  const RefineOptions &opts = {});
 
 }  // namespace hmcos
\ No newline at end of file
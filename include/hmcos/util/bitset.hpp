@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+namespace hmcos {
+
+/// Bitset of runtime length. Sets of up to `INLINE_BITS` elements are stored
+/// inline, so that copying small sets does not touch the heap.
+class SmallBitset {
+public:
+    static constexpr uint32_t INLINE_WORDS = 2;
+    static constexpr uint32_t INLINE_BITS = INLINE_WORDS * 64;
+
+    explicit SmallBitset(size_t nBits = 0)
+        : nWords(uint32_t((nBits + 63) / 64)) {
+        if (isInline())
+            std::memset(inl, 0, sizeof(inl));
+        else
+            heap = new uint64_t[nWords]();
+    }
+
+    SmallBitset(const SmallBitset &other) : nWords(other.nWords) {
+        if (isInline())
+            std::memcpy(inl, other.inl, sizeof(inl));
+        else {
+            heap = new uint64_t[nWords];
+            std::memcpy(heap, other.heap, nWords * sizeof(uint64_t));
+        }
+    }
+
+    SmallBitset(SmallBitset &&other) noexcept : nWords(other.nWords) {
+        if (isInline())
+            std::memcpy(inl, other.inl, sizeof(inl));
+        else {
+            heap = other.heap;
+            other.nWords = 0;
+        }
+    }
+
+    SmallBitset &operator=(SmallBitset other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~SmallBitset() {
+        if (!isInline()) delete[] heap;
+    }
+
+    bool Test(size_t i) const { return words()[i / 64] >> (i % 64) & 1; }
+    void Set(size_t i) { words()[i / 64] |= uint64_t(1) << (i % 64); }
+    void Reset(size_t i) { words()[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+
+    /// Number of words used to store this set
+    uint32_t NumWords() const { return nWords; }
+    /// Raw word storage
+    const uint64_t *Words() const { return words(); }
+    uint64_t *Words() { return words(); }
+
+    bool operator==(const SmallBitset &other) const {
+        return nWords == other.nWords &&
+               std::memcmp(words(), other.words(),
+                           nWords * sizeof(uint64_t)) == 0;
+    }
+
+    void swap(SmallBitset &other) noexcept {
+        std::swap(nWords, other.nWords);
+        uint64_t tmp[INLINE_WORDS];
+        std::memcpy(tmp, inl, sizeof(inl));
+        std::memcpy(inl, other.inl, sizeof(inl));
+        std::memcpy(other.inl, tmp, sizeof(inl));
+    }
+
+private:
+    bool isInline() const { return nWords <= INLINE_WORDS; }
+    uint64_t *words() { return isInline() ? inl : heap; }
+    const uint64_t *words() const { return isInline() ? inl : heap; }
+
+    /// Number of 64-bit words
+    uint32_t nWords;
+    /// Inline words, or pointer to words on heap
+    union {
+        uint64_t inl[INLINE_WORDS];
+        uint64_t *heap;
+    };
+};
+
+}  // namespace hmcos
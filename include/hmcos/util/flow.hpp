@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace hmcos {
+
+/// Flow network with integer capacities, solved with Dinic's algorithm
+/// Nodes are numbered from zero. Augmenting paths are found with explicit
+/// stack, so long paths do not overflow call stack.
+class FlowNetwork {
+public:
+    explicit FlowNetwork(uint32_t numNodes) : adj(numNodes) {}
+
+    /// Add a directed edge with capacity `cap`
+    void AddEdge(uint32_t from, uint32_t to, uint64_t cap);
+
+    /// Compute maximum flow from `src` to `sink`. Capacities of edges are
+    /// replaced by their residual capacities.
+    uint64_t MaxFlow(uint32_t src, uint32_t sink);
+
+    /// Whether each node can reach `sink` in residual network. Nodes that
+    /// cannot reach sink form the largest source side of all minimum cuts.
+    std::vector<bool> ReachSink(uint32_t sink) const;
+
+private:
+    bool buildLevels(uint32_t src, uint32_t sink);
+    uint64_t augment(uint32_t src, uint32_t sink);
+
+    struct Edge {
+        uint32_t to;
+        uint64_t cap;
+    };
+
+    /// Edge `e ^ 1` is the reverse edge of `e`
+    std::vector<Edge> edges;
+    std::vector<std::vector<uint32_t>> adj;
+    std::vector<uint32_t> level, next;
+};
+
+}  // namespace hmcos
@@ -4,6 +4,18 @@
 
 namespace hmcos {
 
+/// Kind of op that decides how its memory is handled
+enum class OpKind {
+    /// Output can reuse memory of an input of the same size
+    ELEMENT_WISE,
+    /// Output is a reinterpretation of its input, and can also reuse it
+    REINTERPRET,
+    OTHER,
+};
+
+/// Kind of op with given type name
+OpKind GetOpKind(const std::string &type);
+
 bool IsElementWise(const std::string &name);
 
 bool IsReinterpret(const std::string &name);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hmcos {
+
+/// Pool of threads that persist across parallel loops
+/// Loops such as those over each DP layer are run many times, so threads are
+/// created once instead of for each loop. The calling thread of a loop also
+/// runs its iterations, and runs those not yet started by the pool before
+/// waiting for the rest. Loops nested in iterations therefore finish even if
+/// all threads of the pool are busy.
+class ThreadPool {
+public:
+    /// Create pool with `nThreads` threads besides callers of loops
+    explicit ThreadPool(size_t nThreads);
+    ~ThreadPool();
+
+    /// Pool shared by the process, with one thread less than hardware threads
+    static ThreadPool &Global();
+
+    /// Run `func(i)` for each `i` in `[0, n)`. `func(0)` is run on the calling
+    /// thread. Iterations may run one after another on the same thread, so
+    /// they must not wait for each other. Return after all calls finish.
+    void Run(size_t n, const std::function<void(size_t)> &func);
+
+private:
+    /// Iterations of one loop, claimed by pool threads and the caller
+    struct Job {
+        const std::function<void(size_t)> *func;
+        size_t n;
+        std::atomic<size_t> next{1};
+        size_t nDone = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    /// Run unclaimed iterations of job
+    static void work(Job &job);
+    void loop();
+
+    std::vector<std::thread> threads;
+    /// Each entry lets one pool thread join a job
+    std::deque<std::shared_ptr<Job>> queue;
+    bool stopped = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+};
+
+/// Run `func(i)` for each `i` in `[0, n)` on the shared thread pool. `func(0)`
+/// is run on the calling thread, and a single iteration is run without the
+/// pool. Return after all calls finish.
+template <class F>
+inline void ParallelFor(size_t n, F func) {
+    if (n == 0) return;
+    if (n == 1) {
+        func(size_t(0));
+        return;
+    }
+    ThreadPool::Global().Run(n, std::ref(func));
+}
+
+}  // namespace hmcos
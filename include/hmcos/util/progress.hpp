@@ -9,16 +9,18 @@ namespace hmcos {
 void PrintProgress(size_t index, size_t size,
                    std::chrono::system_clock::time_point start);
 
-template <bool display>
+/// Iterator of indices that prints progress bar as it advances, if display is
+/// enabled
 class ProgressIter {
 public:
     using Clock = std::chrono::system_clock;
 
-    ProgressIter(size_t index, size_t size) : index(index), size(size) {}
+    ProgressIter(size_t index, size_t size, bool display)
+        : index(index), size(size), display(display) {}
 
     void operator++() {
         index++;
-        if constexpr (display) PrintProgress(index, size, start);
+        if (display) PrintProgress(index, size, start);
     }
 
     size_t operator*() const { return index; }
@@ -30,25 +32,30 @@ public:
 private:
     size_t index;
     size_t size;
+    bool display;
     Clock::time_point start = Clock::now();
 };
 
-template <bool display = true>
+/// Range of indices in [0, size) with progress display
 class ProgressRange {
 public:
-    ProgressRange(size_t size) : size(size) {}
+    ProgressRange(size_t size, bool display = true)
+        : size(size), display(display) {}
 
     auto begin() const {
-        PrintProgress(0, size, {});
-        return ProgressIter<display>(0, size);
+        if (display) PrintProgress(0, size, {});
+        return ProgressIter(0, size, display);
     }
 
-    auto end() const { return ProgressIter<display>(size, size); }
+    auto end() const { return ProgressIter(size, size, display); }
 
-    ~ProgressRange() { if constexpr (display) printf("\n"); }
+    ~ProgressRange() {
+        if (display) printf("\n");
+    }
 
 private:
     size_t size;
+    bool display;
 };
 
-}  // namespace hmcos
\ No newline at end of file
+}  // namespace hmcos
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace hmcos {
+
+/// Temporary file for spilling data that does not fit in memory
+/// Data is appended to the file, which can then be mapped into memory for
+/// reading. The file is removed when this object is destroyed.
+class SpillFile {
+public:
+    /// Create an empty file in directory `dir`
+    explicit SpillFile(const std::string &dir);
+    ~SpillFile();
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    /// Append bytes to the end of file
+    void Append(const void *data, size_t size);
+
+    /// Size of file in bytes, including data not yet flushed
+    size_t Size() const { return fileSize + buf.size(); }
+
+    /// Map the whole file into memory for reading. Return null if the file is
+    /// empty.
+    const char *Map();
+
+    /// Unmap the file if it is mapped
+    void Unmap();
+
+private:
+    void flush();
+
+#if defined(WIN32)
+    /// Handles of file and its mapping
+    void *file = nullptr, *mapping = nullptr;
+#else
+    /// File descriptor
+    int fd = -1;
+#endif
+    /// Address where the file is mapped
+    const char *mapped = nullptr;
+    /// Number of bytes written to file
+    size_t fileSize = 0;
+    /// Data to be written to file
+    std::vector<char> buf;
+};
+
+}  // namespace hmcos
@@ -0,0 +1,372 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <hmcos/sched/bound.hpp>
+#include <hmcos/sched/flat.hpp>
+#include <hmcos/sched/life.hpp>
+#include <hmcos/sched/plan.hpp>
+#include <hmcos/sched/sched.hpp>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+
+using namespace hmcos;
+using namespace std::chrono;
+
+static const char *USAGE =
+    "Usage: batch_sched <modelDir|manifest> <output.csv|output.json> "
+    "[options]\n"
+    "Options:\n"
+    "  -j <n>            number of scheduling threads (default: all cores)\n"
+    "  --io <n>          number of model loading threads (default: 1)\n"
+    "  --method <m>      hier, serenity or rpo (default: hier)\n"
+    "  --cache <path>    persistent group schedule cache\n"
+    "  --timeout <sec>   time limit of hierarchical scheduling per model\n"
+    "  --refine <ms>     refine each schedule with local search for this time\n"
+    "  --samples <n>     schedules sampled per group in serenity scheduling\n"
+    "                    (default: 100)\n"
+    "  --join <0|1>      join ops to sequences in serenity scheduling\n"
+    "                    (default: 1)\n"
+    "  --try-simple <0|1>\n"
+    "                    try reverse post-order of each group first in\n"
+    "                    serenity scheduling (default: 1)\n"
+    "  --max-peak <kb>   skip models whose peak lower bound exceeds this\n"
+    "  --planner <p>     first-fit, best-fit, greedy-size, greedy-breadth or\n"
+    "                    portfolio memory planner (default: first-fit)\n";
+
+/// Options of batch scheduling
+struct BatchOptions {
+    std::string input, output;
+    size_t nWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t nLoaders = 1;
+    std::string method = "hier";
+    std::string cachePath;
+    size_t timeout = 0;
+    size_t refineMs = 0;
+    size_t nSamples = 100;
+    bool joinOps = true, trySimple = true;
+    uint64_t maxPeak = 0;
+    PlanOptions plan{PlanMethod::FIRST_FIT, 64};
+};
+
+/// Result of scheduling one model
+struct ModelResult {
+    std::string path;
+    std::string error;
+    size_t nOps = 0;
+    uint64_t lowerBound = 0, peak = 0, arenaSize = 0;
+    int64_t loadMs = 0, schedMs = 0;
+};
+
+/// Model loaded and waiting to be scheduled
+struct LoadedModel {
+    size_t index;
+    std::unique_ptr<Graph> graph;
+};
+
+/// Queue with bounded capacity that blocks producers when it is full and
+/// consumers when it is empty
+template <class T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity) : capacity(capacity) {}
+
+    void Push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return queue.size() < capacity; });
+        queue.push(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    /// Pop an item. Return nothing if the queue is closed and empty.
+    std::optional<T> Pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !queue.empty() || closed; });
+        if (queue.empty()) return std::nullopt;
+        auto item = std::move(queue.front());
+        queue.pop();
+        notFull.notify_one();
+        return item;
+    }
+
+    /// Mark that no more item will be pushed
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::queue<T> queue;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+};
+
+static BatchOptions parseOptions(int argc, char const *argv[]) {
+    if (argc < 3) {
+        fmt::print(stderr, "{}", USAGE);
+        std::exit(1);
+    }
+    BatchOptions opts;
+    opts.input = argv[1];
+    opts.output = argv[2];
+    for (auto i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) LOG(FATAL) << "Missing value of option " << arg;
+        std::string value = argv[++i];
+        if (arg == "-j")
+            opts.nWorkers = std::max(std::stoul(value), 1ul);
+        else if (arg == "--io")
+            opts.nLoaders = std::max(std::stoul(value), 1ul);
+        else if (arg == "--method")
+            opts.method = value;
+        else if (arg == "--cache")
+            opts.cachePath = value;
+        else if (arg == "--timeout")
+            opts.timeout = std::stoul(value);
+        else if (arg == "--refine")
+            opts.refineMs = std::stoul(value);
+        else if (arg == "--samples")
+            opts.nSamples = std::stoul(value);
+        else if (arg == "--join")
+            opts.joinOps = std::stoul(value) != 0;
+        else if (arg == "--try-simple")
+            opts.trySimple = std::stoul(value) != 0;
+        else if (arg == "--max-peak")
+            opts.maxPeak = std::stoull(value) * 1024;
+        else if (arg == "--planner") {
+            if (value == "first-fit")
+                opts.plan.method = PlanMethod::FIRST_FIT;
+            else if (value == "best-fit")
+                opts.plan.method = PlanMethod::BEST_FIT;
+            else if (value == "greedy-size")
+                opts.plan.method = PlanMethod::GREEDY_BY_SIZE;
+            else if (value == "greedy-breadth")
+                opts.plan.method = PlanMethod::GREEDY_BY_BREADTH;
+            else if (value == "portfolio")
+                opts.plan.method = PlanMethod::PORTFOLIO;
+            else
+                LOG(FATAL) << "Unknown memory planner " << value;
+        } else
+            LOG(FATAL) << "Unknown option " << arg;
+    }
+    if (opts.method != "hier" && opts.method != "serenity" &&
+        opts.method != "rpo")
+        LOG(FATAL) << "Unknown scheduling method " << opts.method;
+    return opts;
+}
+
+/// List models in a directory, or in a manifest file with one path per line
+static std::vector<std::string> listModels(const std::string &input) {
+    std::vector<std::string> paths;
+    if (std::filesystem::is_directory(input)) {
+        for (auto &entry : std::filesystem::directory_iterator(input))
+            if (entry.path().extension() == ".onnx")
+                paths.push_back(entry.path().string());
+        std::sort(paths.begin(), paths.end());
+    } else {
+        std::ifstream ifs(input);
+        if (!ifs) LOG(FATAL) << "Cannot open manifest " << input;
+        auto dir = std::filesystem::path(input).parent_path();
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::filesystem::path path(line);
+            paths.push_back((path.is_relative() ? dir / path : path).string());
+        }
+    }
+    return paths;
+}
+
+static void scheduleModel(const Graph &graph, const BatchOptions &opts,
+                          GroupCache *cache, ModelResult &result) {
+    // Screen model with lower bound of peak
+    auto begin = steady_clock::now();
+    result.lowerBound = ComputePeakBound(graph).lower;
+    if (opts.maxPeak != 0 && result.lowerBound > opts.maxPeak) {
+        result.error = "peak lower bound exceeds limit";
+        return;
+    }
+
+    // Schedule model
+    // Progress bars are not displayed, since workers share standard output.
+    std::vector<OpRef> sched;
+    SchedOptions schedOpts;
+    schedOpts.groupCache = cache;
+    schedOpts.displayProgress = false;
+    if (opts.method == "rpo")
+        sched = ReversePostOrder(graph);
+    else if (opts.method == "serenity")
+        sched = SerenitySchedule(graph, opts.joinOps, opts.trySimple,
+                                 opts.nSamples, schedOpts);
+    else {
+        if (opts.timeout > 0)
+            schedOpts.deadline = begin + seconds(opts.timeout);
+        sched = HierarchicalSchedule(graph, schedOpts);
+    }
+    if (opts.refineMs > 0) {
+        RefineOptions refineOpts;
+        refineOpts.timeLimit = milliseconds(opts.refineMs);
+        sched = RefineSchedule(graph, sched, refineOpts);
+    }
+    result.schedMs =
+        duration_cast<milliseconds>(steady_clock::now() - begin).count();
+    result.nOps = sched.size();
+    FlatGraph flat(graph);
+    auto compiled = flat.Compile(sched);
+    result.peak = flat.EstimatePeak(compiled);
+    result.arenaSize =
+        PlanMemory(flat.ComputeLifetime(compiled), opts.plan).peak;
+}
+
+/// Escape string in CSV or JSON with `escape` prepended to each `"`, and also
+/// to each `\` in JSON. Control characters are written as `\u` escapes in
+/// JSON, while CSV keeps them inside quotes.
+static std::string escapeString(const std::string &str, char escape) {
+    std::string result;
+    for (auto c : str) {
+        if (escape == '\\' && uint8_t(c) < 0x20) {
+            result += fmt::format("\\u{:04x}", int(c));
+            continue;
+        }
+        if (c == '"' || (escape == '\\' && c == '\\')) result.push_back(escape);
+        result.push_back(c);
+    }
+    return result;
+}
+
+/// Writer of results in CSV or JSON, decided by extension of output file
+/// Each result is written and flushed as soon as its model finishes, so that
+/// results of finished models are kept if the process is aborted later. Rows
+/// are therefore in order of completion instead of order of models.
+class ResultWriter {
+public:
+    explicit ResultWriter(const std::string &path)
+        : ofs(path),
+          json(std::filesystem::path(path).extension() == ".json") {
+        if (!ofs) LOG(FATAL) << "Cannot open output file " << path;
+        if (json)
+            ofs << "[";
+        else
+            ofs << "model,ops,lower_bound,peak,arena_size,load_ms,sched_ms,"
+                   "error\n";
+        ofs.flush();
+    }
+
+    ~ResultWriter() {
+        if (json) ofs << (nWritten > 0 ? "\n]\n" : "]\n");
+    }
+
+    void Write(const ModelResult &r) {
+        std::string row;
+        if (json)
+            row = fmt::format(
+                "  {{\"model\": \"{}\", \"ops\": {}, \"lower_bound\": {}, "
+                "\"peak\": {}, \"arena_size\": {}, \"load_ms\": {}, "
+                "\"sched_ms\": {}, \"error\": \"{}\"}}",
+                escapeString(r.path, '\\'), r.nOps, r.lowerBound, r.peak,
+                r.arenaSize, r.loadMs, r.schedMs, escapeString(r.error, '\\'));
+        else
+            row = fmt::format("\"{}\",{},{},{},{},{},{},\"{}\"\n",
+                              escapeString(r.path, '"'), r.nOps, r.lowerBound,
+                              r.peak, r.arenaSize, r.loadMs, r.schedMs,
+                              escapeString(r.error, '"'));
+        std::lock_guard<std::mutex> lock(mutex);
+        if (json) ofs << (nWritten > 0 ? ",\n" : "\n");
+        ofs << row;
+        ofs.flush();
+        nWritten++;
+    }
+
+private:
+    std::ofstream ofs;
+    bool json;
+    size_t nWritten = 0;
+    std::mutex mutex;
+};
+
+int main(int argc, char const *argv[]) {
+    // Initialize glog. Only warnings and errors are printed, since logs of
+    // concurrent models would be interleaved.
+    FLAGS_minloglevel = 1;
+    google::LogToStderr();
+    google::InitGoogleLogging(argv[0]);
+
+    // List models
+    auto opts = parseOptions(argc, argv);
+    auto paths = listModels(opts.input);
+    std::vector<ModelResult> results(paths.size());
+    for (auto [i, path] : EnumRange(paths)) results[i].path = path;
+    ResultWriter writer(opts.output);
+    std::unique_ptr<GroupCache> cache;
+    if (!opts.cachePath.empty())
+        cache = std::make_unique<GroupCache>(opts.cachePath);
+
+    // Load models on I/O threads, and build graphs for scheduling threads
+    // Loaded graphs are bounded, so that loaders do not run too far ahead.
+    auto begin = steady_clock::now();
+    BlockingQueue<LoadedModel> queue(2 * opts.nWorkers);
+    std::atomic<size_t> nextModel{0}, nFinished{0};
+    auto load = [&] {
+        while (true) {
+            auto i = nextModel++;
+            if (i >= paths.size()) return;
+            auto loadBegin = steady_clock::now();
+            std::ifstream ifs(paths[i], std::ifstream::binary);
+            onnx::ModelProto model;
+            if (!ifs || !model.ParseFromIstream(&ifs)) {
+                results[i].error = "cannot parse model";
+                writer.Write(results[i]);
+                nFinished++;
+                continue;
+            }
+            // Graph constructor panics on malformed models, e.g. those
+            // without shape inference
+            if (auto error = Graph::Check(model); !error.empty()) {
+                results[i].error = error;
+                writer.Write(results[i]);
+                nFinished++;
+                continue;
+            }
+            auto graph = std::make_unique<Graph>(
+                model, std::filesystem::path(paths[i]).stem().string());
+            results[i].loadMs =
+                duration_cast<milliseconds>(steady_clock::now() - loadBegin)
+                    .count();
+            queue.Push({i, std::move(graph)});
+        }
+    };
+
+    // Schedule graphs on worker threads
+    auto work = [&] {
+        while (auto loaded = queue.Pop()) {
+            auto &result = results[loaded->index];
+            scheduleModel(*loaded->graph, opts, cache.get(), result);
+            loaded->graph.reset();
+            writer.Write(result);
+            fmt::print(stderr, "[{}/{}] {}: peak {} KB, {} ms\n", ++nFinished,
+                       paths.size(), result.path, result.peak / 1024,
+                       result.schedMs);
+        }
+    };
+
+    std::vector<std::thread> loaders, workers;
+    for (auto i = 0u; i < opts.nLoaders; i++) loaders.emplace_back(load);
+    for (auto i = 0u; i < opts.nWorkers; i++) workers.emplace_back(work);
+    for (auto &thread : loaders) thread.join();
+    queue.Close();
+    for (auto &thread : workers) thread.join();
+
+    fmt::print(stderr, "Scheduled {} models in {} s.\n", paths.size(),
+               duration_cast<seconds>(steady_clock::now() - begin).count());
+    if (cache)
+        fmt::print(stderr, "Group cache: {} hits, {} misses.\n", cache->Hits(),
+                   cache->Misses());
+
+    return 0;
+}
@@ -3,6 +3,8 @@
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <hmcos/sched/bound.hpp>
+#include <hmcos/sched/flat.hpp>
 #include <hmcos/sched/life.hpp>
 #include <hmcos/sched/pass.hpp>
 #include <hmcos/sched/plan.hpp>
@@ -45,14 +47,41 @@ int main(int argc, char const *argv[]) {
     Graph graph(model, std::filesystem::path(argv[1]).stem().string());
     model.Clear();
 
+    // Open group schedule cache if its path is given
+    std::unique_ptr<GroupCache> cache;
+    SchedOptions opts;
+    if (argc > 2) {
+        cache = std::make_unique<GroupCache>(argv[2]);
+        opts.groupCache = cache.get();
+    }
+
+    // Compile graph for evaluating schedules
+    FlatGraph flat(graph);
+
+    // Compute bounds of peak
+    PeakBound bound;
+    TIME_CODE(bound = ComputePeakBound(graph);)
+    LOG(INFO) << fmt::format("Peak Bounds: [{}, {}] KB", bound.lower / 1024,
+                             bound.upper / 1024);
+
     // Schedule hierarchical graph
     std::vector<OpRef> sched;
-    TIME_CODE(sched = HierarchicalSchedule(graph);)
-    LOG(INFO) << "HMCOS Peak: " << EstimatePeak(sched, graph.inputs) / 1024 << " KB";
-    LOG(INFO) << "HMCOS Arena Size: " << computeArenaSize(ComputeLifetime(sched, graph)) / 1024 << " KB";
+    TIME_CODE(sched = HierarchicalSchedule(graph, opts);)
+    auto peak = flat.EstimatePeak(sched);
+    LOG(INFO) << "HMCOS Peak: " << peak / 1024 << " KB";
+    LOG(INFO) << fmt::format("HMCOS Optimality Gap: {:.2f}%",
+                             bound.Gap(peak) * 100);
+    LOG(INFO) << "HMCOS Arena Size: "
+              << computeArenaSize(flat.ComputeLifetime(sched)) / 1024 << " KB";
+
+    // Refine HMCOS schedule with local search
+    TIME_CODE(sched = RefineSchedule(graph, sched);)
+    LOG(INFO) << "Refined HMCOS Peak: " << flat.EstimatePeak(sched) / 1024
+              << " KB";
     sched = ReversePostOrder(graph);
-    LOG(INFO) << "RPO Peak: " << EstimatePeak(sched, graph.inputs) / 1024 << " KB";
-    LOG(INFO) << "RPO Arena Size: " << computeArenaSize(ComputeLifetime(sched, graph)) / 1024 << " KB";
+    LOG(INFO) << "RPO Peak: " << flat.EstimatePeak(sched) / 1024 << " KB";
+    LOG(INFO) << "RPO Arena Size: "
+              << computeArenaSize(flat.ComputeLifetime(sched)) / 1024 << " KB";
 
     return 0;
 }
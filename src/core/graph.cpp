@@ -2,6 +2,7 @@
 #include <hmcos/util/fmt.hpp>
 #include <hmcos/util/viz.hpp>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace hmcos {
 
@@ -66,6 +67,50 @@ Graph::Graph(const onnx::ModelProto &model, const std::string &name) {
     ConnectVerts();
 }
 
+std::string Graph::Check(const onnx::ModelProto &model) {
+    // Check types of values
+    auto &graph = model.graph();
+    std::unordered_set<std::string> names;
+    std::string error;
+    auto checkInfo = [&](const onnx::ValueInfoProto &info) {
+        names.insert(info.name());
+        for (auto &dim : info.type().tensor_type().shape().dim())
+            if (!dim.has_dim_value() && error.empty())
+                error = fmt::format("{} is not a dimension value.",
+                                    dim.dim_param());
+    };
+    for (auto &info : graph.input()) checkInfo(info);
+    for (auto &info : graph.output()) checkInfo(info);
+    for (auto &info : graph.value_info()) checkInfo(info);
+    if (!error.empty()) return error;
+
+    // Check data types of parameters
+    for (auto &tensor : graph.initializer()) {
+        auto type = tensor.data_type();
+        if (type <= onnx::TensorProto::UNDEFINED ||
+            type > onnx::TensorProto::BFLOAT16)
+            return fmt::format("Unknown data type {} of parameter {}.", type,
+                               tensor.name());
+        if (type == onnx::TensorProto::STRING)
+            return fmt::format("Cannot get tensor data of type {}",
+                               FmtDataType(type));
+        names.insert(tensor.name());
+    }
+
+    // Check that all values used by ops are defined
+    for (auto &node : graph.node()) {
+        for (auto &in : node.input())
+            if (!Contains(names, in))
+                return fmt::format("Cannot find information of value {}.", in);
+        for (auto &out : node.output())
+            if (!Contains(names, out))
+                return fmt::format("Cannot find information of value {}.",
+                                   out);
+    }
+
+    return {};
+}
+
 void Graph::ConnectVerts() {
     for (auto &op : ops) {
         for (auto &in : op->inputs) {
@@ -74,6 +119,50 @@ void Graph::ConnectVerts() {
         }
     }
     for (auto &out : outputs) Vertex::Connect(out->value->Vertex(), out);
+    Index();
+}
+
+void Graph::Index() {
+    // Number vertices
+    verts.clear();
+    verts.reserve(ops.size() + inputs.size() + outputs.size());
+    auto addVert = [&](Vertex *vert) {
+        vert->id = uint32_t(verts.size());
+        verts.push_back(vert);
+    };
+    for (auto &op : ops) addVert(op.get());
+    for (auto &in : inputs) addVert(in.get());
+    for (auto &out : outputs) addVert(out.get());
+
+    // Number values
+    values.clear();
+    auto addValue = [&](Value *val) {
+        val->id = uint32_t(values.size());
+        values.push_back(val);
+    };
+    for (auto &in : inputs) addValue(in->value.get());
+    for (auto &param : params) addValue(param.get());
+    for (auto &op : ops)
+        for (auto &out : op->outputs) addValue(out.get());
+
+    // Build adjacency arrays
+    predBegin.assign(1, 0);
+    succBegin.assign(1, 0);
+    predIdx.clear();
+    succIdx.clear();
+    for (auto vert : verts) {
+        for (auto &pred : vert->preds) predIdx.push_back(pred.lock()->id);
+        for (auto &succ : vert->succs) succIdx.push_back(succ->id);
+        predBegin.push_back(uint32_t(predIdx.size()));
+        succBegin.push_back(uint32_t(succIdx.size()));
+    }
+}
+
+VertexRef VertexCloner::Visit(const VertexRef &vert) {
+    PostorderTraverse<PredsOf>(
+        vert, [&](const VertexRef &v) { return !Contains(memo, v); },
+        [&](const VertexRef &v) { VertexVisitor::Visit(v); });
+    return memo[vert];
 }
 
 VertexRef VertexCloner::VisitInput(const InputRef &input) {
@@ -86,7 +175,6 @@ VertexRef VertexCloner::VisitInput(const InputRef &input) {
 VertexRef VertexCloner::VisitOutput(const OutputRef &output) {
     auto &val = output->value;
     auto newVal = VisitValue(val);
-    Visit(val->Vertex());
     return std::make_shared<Output>(newVal);
 }
 
@@ -96,7 +184,6 @@ VertexRef VertexCloner::VisitOp(const OpRef &op) {
         auto newIn = VisitValue(in);
         newOp->inputs.push_back(newIn);
         newIn->uses.push_back(newOp);
-        if (in->kind != ValueKind::PARAM) Visit(in->Vertex());
     }
     for (auto &out : op->outputs) {
         auto newOut = VisitValue(out);
@@ -43,34 +43,40 @@ void Group::Dump() const {
     for (auto &[val, cnt] : produced) LOG(INFO) << val->name << " " << cnt;
 }
 
-HierGraph::HierGraph(const Graph &graph) : graph(graph) {
+HierGraph::HierGraph(const Graph &graph)
+    : graph(graph), nextId(graph.NumVerts()) {
     // Initialize inputs and outputs
-    std::unordered_map<VertexRef, HierVertRef> vertMap;
+    std::vector<HierVertRef> vertMap(graph.NumVerts());
     for (auto &in : graph.inputs) {
         auto hierIn = std::make_shared<HierInput>(in->value);
+        hierIn->id = in->id;
         inputs.push_back(hierIn);
-        vertMap.insert({in, hierIn});
+        vertMap[in->id] = hierIn;
     }
     for (auto &out : graph.outputs) {
         auto hierOut = std::make_shared<HierOutput>(out->value);
+        hierOut->id = out->id;
         outputs.push_back(hierOut);
-        vertMap.insert({out, hierOut});
+        vertMap[out->id] = hierOut;
     }
 
     // Map ops to sequences (with one op)
-    std::vector<SequenceRef> seqs;
+    opToSeq.reserve(graph.ops.size());
     for (auto &op : graph.ops) {
         auto seq = std::make_shared<Sequence>(op);
-        seqs.push_back(seq);
-        vertMap.insert({op, seq});
+        seq->id = op->id;
+        vertMap[op->id] = seq;
+        opToSeq.insert({op, seq});
     }
 
     // Connect vertices
-    for (auto &[vert, hier] : vertMap) {
-        for (auto &pred : vert->preds)
-            hier->preds.push_back(vertMap[pred.lock()]);
-        for (auto &succ : vert->succs) hier->succs.push_back(vertMap[succ]);
-        if (Is<Op>(vert)) opToSeq.insert({Cast<Op>(vert), As<Sequence>(hier)});
+    for (auto [id, hier] : EnumRange(vertMap)) {
+        auto preds = graph.PredIds(uint32_t(id));
+        auto succs = graph.SuccIds(uint32_t(id));
+        hier->preds.reserve(preds.size());
+        hier->succs.reserve(succs.size());
+        for (auto pred : preds) hier->preds.push_back(vertMap[pred]);
+        for (auto succ : succs) hier->succs.push_back(vertMap[succ]);
     }
 }
 
@@ -165,58 +171,42 @@ void HierGraph::PlotTop(const std::string &dir, const std::string &name,
     creator.Render(dir, format);
 }
 
-class HierDomVizVisitor
-    : public DomTreeVisitor<HierVertex, Unit, const HierDomNodeRef &> {
-public:
-    HierDomVizVisitor(DotCreator<HierDomNodeRef> &creator) : creator(creator) {}
+/// Plot a dominator tree with labels of vertices in hierarchical graph
+static void plotDomTree(const HierGraph &hier, const DomTree &tree,
+                        const std::string &dir, const std::string &name,
+                        const std::string &format) {
+    // Map IDs to vertices
+    std::unordered_map<uint32_t, HierVertRef> idToVert;
+    for (auto &in : hier.inputs) idToVert.insert({in->id, in});
+    for (auto &out : hier.outputs) idToVert.insert({out->id, out});
+    for (auto &[op, seq] : hier.opToSeq) idToVert.insert({seq->id, seq});
 
-    Unit Visit(const HierDomNodeRef &node,
-               const HierDomNodeRef &parent) override {
-        if (!node) {
-            LOG(ERROR) << "Dominator tree node not defined.";
-            return {};
-        }
-        creator.Node(node, node->vertex.lock()->Label());
-        for (auto &childWeak : node->children) {
-            auto child = childWeak.lock();
-            Visit(child, node);
-            creator.Edge(node, child);
-        }
-        return {};
+    // Add nodes and edges
+    DotCreator<HierVertRef> creator(name);
+    for (auto id : tree.Verts()) {
+        auto &vert = idToVert.at(id);
+        creator.Node(vert, vert->Label());
+        if (id != tree.Root()) creator.Edge(idToVert.at(tree.IDom(id)), vert);
     }
-
-private:
-    DotCreator<HierDomNodeRef> &creator;
-};
+    creator.Render(dir, format);
+}
 
 void HierGraph::PlotDom(const std::string &dir, const std::string &name,
                         const std::string &format) {
-    if (inputs.empty()) {
-        LOG(ERROR) << "Input list of the hierarchical graph is empty.";
-        return;
-    }
-    if (!inputs[0]->dom) {
+    if (!dom) {
         LOG(ERROR) << "Dominator tree has not been built.";
         return;
     }
-    DotCreator<HierDomNodeRef> creator(name);
-    HierDomVizVisitor(creator).Visit(inputs[0]->dom, nullptr);
-    creator.Render(dir, format);
+    plotDomTree(*this, *dom, dir, name, format);
 }
 
 void HierGraph::PlotPostDom(const std::string &dir, const std::string &name,
                             const std::string &format) {
-    if (outputs.empty()) {
-        LOG(ERROR) << "Output list of the hierarchical graph is empty.";
-        return;
-    }
-    if (!outputs[0]->postDom) {
+    if (!postDom) {
         LOG(ERROR) << "Post-dominator tree has not been built.";
         return;
     }
-    DotCreator<HierDomNodeRef> creator(name);
-    HierDomVizVisitor(creator).Visit(outputs[0]->postDom, nullptr);
-    creator.Render(dir, format);
+    plotDomTree(*this, *postDom, dir, name, format);
 }
 
 }  // namespace hmcos
\ No newline at end of file
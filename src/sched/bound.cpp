@@ -0,0 +1,129 @@
+#include <hmcos/core/dom.hpp>
+#include <hmcos/sched/bound.hpp>
+#include <hmcos/sched/flat.hpp>
+#include <hmcos/sched/life.hpp>
+#include <hmcos/sched/mem.hpp>
+#include <hmcos/sched/sched.hpp>
+
+namespace hmcos {
+
+/// Find ops that dominate the virtual exit of graph, in topological order
+/// `preds` lists predecessors of each node in topological order. Node 0 is the
+/// virtual entry, and the last node is the virtual exit.
+static std::vector<uint32_t> findCutNodes(
+    const std::vector<std::vector<uint32_t>> &preds) {
+    // Build successor lists in compressed arrays
+    auto n = uint32_t(preds.size());
+    std::vector<uint32_t> succBegin(n + 1, 0), succs;
+    for (auto &nodePreds : preds)
+        for (auto p : nodePreds) succBegin[p + 1]++;
+    std::partial_sum(succBegin.begin(), succBegin.end(), succBegin.begin());
+    succs.resize(succBegin[n]);
+    auto fill = succBegin;
+    for (auto v = 0u; v < n; v++)
+        for (auto p : preds[v]) succs[fill[p]++] = v;
+
+    // Number nodes in depth-first pre-order from entry. Every node is
+    // reachable from entry, since each op has at least one predecessor.
+    constexpr auto NONE = DomTree::NONE;
+    std::vector<uint32_t> num(n, NONE), node, parent;
+    std::vector<std::pair<uint32_t, uint32_t>> stack{{0, 0}};
+    while (!stack.empty()) {
+        auto [v, par] = stack.back();
+        stack.pop_back();
+        if (num[v] != NONE) continue;
+        num[v] = uint32_t(node.size());
+        node.push_back(v);
+        parent.push_back(par);
+        for (auto i = succBegin[v + 1]; i > succBegin[v]; i--)
+            stack.push_back({succs[i - 1], num[v]});
+    }
+    LOG_ASSERT(node.size() == n);
+
+    // Compute immediate dominators with Semi-NCA algorithm
+    auto idom = SemiNcaIDom(parent, [&](uint32_t v, auto &&f) {
+        for (auto p : preds[node[v]]) f(num[p]);
+    });
+
+    // Collect dominators of exit
+    std::vector<uint32_t> cuts;
+    for (auto v = idom[num[n - 1]]; v != 0; v = idom[v])
+        cuts.push_back(node[v]);
+    std::reverse(cuts.begin(), cuts.end());
+    return cuts;
+}
+
+PeakBound ComputePeakBound(const Graph &graph) {
+    // Upper bound is given by reverse post-order schedule
+    auto order = ReversePostOrder(graph);
+    PeakBound bound;
+    bound.upper = FlatGraph(graph).EstimatePeak(order);
+
+    // Lower bound is at least size of inputs and footprint of each op
+    for (auto &input : graph.inputs) bound.lower += input->value->type.Size();
+    for (auto &op : order)
+        bound.lower = std::max(bound.lower, uint64_t(OpFootprint(op)));
+
+    // Build predecessor lists of ops in topological order, with virtual entry
+    // and exit. Ops producing values that are never used are connected to
+    // exit, since these values are never freed.
+    auto nOps = uint32_t(order.size());
+    std::unordered_map<OpRef, uint32_t> opPos;
+    for (auto [i, op] : EnumRange(order)) opPos.insert({op, uint32_t(i)});
+    std::vector<std::vector<uint32_t>> preds(nOps + 2);
+    for (auto [i, op] : EnumRange(order)) {
+        for (auto &val : op->inputs)
+            if (val->kind == ValueKind::RESULT)
+                preds[i + 1].push_back(opPos.at(val->def.lock()) + 1);
+        if (preds[i + 1].empty()) preds[i + 1].push_back(0);
+        if (std::any_of(op->outputs.begin(), op->outputs.end(),
+                        [](auto &val) { return val->uses.empty(); }))
+            preds[nOps + 1].push_back(i + 1);
+    }
+    if (preds[nOps + 1].empty()) return bound;
+
+    // Find range of positions where each value is alive across an op, i.e.
+    // after it is defined and before its last use
+    std::vector<int64_t> cover(nOps + 1, 0);
+    std::unordered_map<ValueRef, uint32_t> lastUse;
+    auto addValue = [&](const ValueRef &val, uint32_t begin) {
+        uint32_t end = nOps;
+        if (!val->uses.empty()) {
+            end = 0;
+            for (auto &use : val->uses)
+                end = std::max(end, opPos.at(use.lock()));
+        }
+        lastUse.insert({val, end});
+        if (begin >= end) return;
+        cover[begin] += val->type.Size();
+        cover[end] -= val->type.Size();
+    };
+    for (auto &input : graph.inputs) addValue(input->value, 0);
+    for (auto [i, op] : EnumRange(order))
+        for (auto &val : op->outputs) addValue(val, uint32_t(i) + 1);
+    for (auto i = 1u; i <= nOps; i++) cover[i] += cover[i - 1];
+
+    // At each cut op, all other ops are either before or after it, so memory
+    // usage there is the same in every schedule. It includes values alive
+    // across the op, inputs killed by it, and its outputs unless one of them
+    // overlaps a killed input.
+    for (auto node : findCutNodes(preds)) {
+        auto pos = node - 1;
+        auto &op = order[pos];
+        std::vector<ValueRef> killed;
+        auto mem = cover[pos];
+        for (auto &val : op->inputs) {
+            if (val->kind == ValueKind::PARAM || lastUse.at(val) != pos ||
+                Contains(killed, val))
+                continue;
+            killed.push_back(val);
+            mem += val->type.Size();
+        }
+        mem += ComputeIncDec(op, killed).first;
+        bound.lower = std::max(bound.lower, uint64_t(mem));
+    }
+
+    return bound;
+}
+
+}  // namespace hmcos
@@ -0,0 +1,254 @@
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <hmcos/sched/cache.hpp>
+#include <iterator>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace hmcos {
+
+/// Magic number at the beginning of cache file, which also marks its version
+static constexpr char CACHE_MAGIC[8] = {'H', 'M', 'C', 'G', 'C', 'v', '2', 0};
+
+/// Each record in file begins with a marker, length of its payload and checksum
+/// of its payload. Payload consists of key, peak, latest, number of ops and
+/// then op indices.
+static constexpr char RECORD_MARK[4] = {'H', 'M', 'C', 'R'};
+static constexpr size_t RECORD_PREFIX_SIZE =
+    sizeof(RECORD_MARK) + sizeof(uint32_t) + sizeof(uint64_t);
+static constexpr size_t PAYLOAD_HEADER_SIZE =
+    sizeof(GroupCacheKey) + 2 * sizeof(int64_t) + sizeof(uint32_t);
+
+template <class T>
+static void appendBytes(std::vector<char> &buf, const T &data) {
+    auto bytes = reinterpret_cast<const char *>(&data);
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+template <class T>
+static T readBytes(const char *&ptr) {
+    T data;
+    std::memcpy(&data, ptr, sizeof(T));
+    ptr += sizeof(T);
+    return data;
+}
+
+/// 64-bit FNV-1a hash of bytes
+static uint64_t checksum(const char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (auto i = 0u; i < size; i++) {
+        hash ^= uint8_t(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/// Parse one record at `ptr`. Return whether it is complete and intact, and
+/// move `ptr` past it if so.
+static bool parseRecord(const char *&ptr, const char *end, GroupCacheKey &key,
+                        GroupCacheEntry &entry) {
+    auto cur = ptr;
+    if (size_t(end - cur) < RECORD_PREFIX_SIZE ||
+        std::memcmp(cur, RECORD_MARK, sizeof(RECORD_MARK)) != 0)
+        return false;
+    cur += sizeof(RECORD_MARK);
+    auto len = readBytes<uint32_t>(cur);
+    auto sum = readBytes<uint64_t>(cur);
+    if (size_t(end - cur) < len || len < PAYLOAD_HEADER_SIZE ||
+        checksum(cur, len) != sum)
+        return false;
+    key = readBytes<GroupCacheKey>(cur);
+    entry.peak = readBytes<int64_t>(cur);
+    entry.latest = readBytes<int64_t>(cur);
+    auto nOps = readBytes<uint32_t>(cur);
+    if (len != PAYLOAD_HEADER_SIZE + size_t(nOps) * sizeof(uint32_t))
+        return false;
+    entry.ops.resize(nOps);
+    std::memcpy(entry.ops.data(), cur, nOps * sizeof(uint32_t));
+    ptr = cur + nOps * sizeof(uint32_t);
+    return true;
+}
+
+#if defined(WIN32)
+
+static constexpr void *NO_FILE = nullptr;
+
+static void *openFile(const std::string &path) {
+    auto file = CreateFileA(path.c_str(), GENERIC_READ | FILE_APPEND_DATA,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        LOG(FATAL) << "Cannot open group schedule cache " << path << ".";
+    return file;
+}
+
+static void closeFile(void *file) { CloseHandle(file); }
+
+static void lockFile(void *file) {
+    OVERLAPPED ovl{};
+    if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &ovl))
+        LOG(FATAL) << "Cannot lock group schedule cache.";
+}
+
+static void unlockFile(void *file) {
+    OVERLAPPED ovl{};
+    UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &ovl);
+}
+
+static std::vector<char> readFile(void *file) {
+    std::vector<char> content;
+    char buf[1 << 16];
+    DWORD nRead = 0;
+    while (ReadFile(file, buf, sizeof(buf), &nRead, nullptr) && nRead > 0)
+        content.insert(content.end(), buf, buf + nRead);
+    return content;
+}
+
+static bool appendFile(void *file, const std::vector<char> &data) {
+    DWORD written = 0;
+    return WriteFile(file, data.data(), DWORD(data.size()), &written,
+                     nullptr) &&
+           written == data.size();
+}
+
+#else
+
+static constexpr int NO_FILE = -1;
+
+static int openFile(const std::string &path) {
+    auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        LOG(FATAL) << "Cannot open group schedule cache " << path << ": "
+                   << strerror(errno) << ".";
+    return fd;
+}
+
+static void closeFile(int fd) { close(fd); }
+
+static void lockFile(int fd) {
+    while (flock(fd, LOCK_EX) < 0)
+        if (errno != EINTR)
+            LOG(FATAL) << "Cannot lock group schedule cache: "
+                       << strerror(errno) << ".";
+}
+
+static void unlockFile(int fd) { flock(fd, LOCK_UN); }
+
+static std::vector<char> readFile(int fd) {
+    std::vector<char> content;
+    char buf[1 << 16];
+    while (true) {
+        auto nRead = read(fd, buf, sizeof(buf));
+        if (nRead < 0 && errno == EINTR) continue;
+        if (nRead <= 0) break;
+        content.insert(content.end(), buf, buf + nRead);
+    }
+    return content;
+}
+
+static bool appendFile(int fd, const std::vector<char> &data) {
+    // The record is normally written by the first call. The rest is only
+    // written again if the call is interrupted or partial.
+    auto ptr = data.data();
+    auto size = data.size();
+    while (size > 0) {
+        auto written = write(fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return true;
+}
+
+#endif
+
+GroupCache::GroupCache(const std::string &path) {
+    // Load existing entries while no other process appends to the file
+    file = openFile(path);
+    lockFile(file);
+    auto content = readFile(file);
+    std::vector<char> magic(std::begin(CACHE_MAGIC), std::end(CACHE_MAGIC));
+    if (content.empty() && !appendFile(file, magic))
+        LOG(FATAL) << "Cannot write to group schedule cache " << path << ".";
+    unlockFile(file);
+    if (!content.empty() &&
+        (content.size() < sizeof(CACHE_MAGIC) ||
+         std::memcmp(content.data(), CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0))
+        LOG(FATAL) << "File " << path << " is not a group schedule cache.";
+
+    // Records may be incomplete or corrupted if the writing process is killed.
+    // Skip to the next record marker in that case. The file is not modified,
+    // since later records may follow.
+    const char *ptr =
+        content.data() + std::min(content.size(), sizeof(CACHE_MAGIC));
+    const char *end = content.data() + content.size();
+    size_t nSkipped = 0;
+    while (ptr != end) {
+        GroupCacheKey key;
+        GroupCacheEntry entry;
+        if (parseRecord(ptr, end, key, entry)) {
+            entries.insert({key, std::move(entry)});
+            continue;
+        }
+        auto next = std::search(ptr + 1, end, std::begin(RECORD_MARK),
+                                std::end(RECORD_MARK));
+        nSkipped += next - ptr;
+        ptr = next;
+    }
+    if (nSkipped > 0)
+        LOG(WARNING) << nSkipped << " bytes of incomplete or corrupted records "
+                     << "in " << path << " are skipped.";
+}
+
+GroupCache::~GroupCache() {
+    if (file != NO_FILE) closeFile(file);
+}
+
+std::optional<GroupCacheEntry> GroupCache::Find(const GroupCacheKey &key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) return std::nullopt;
+    return it->second;
+}
+
+void GroupCache::Insert(const GroupCacheKey &key,
+                        const GroupCacheEntry &entry) {
+    // Serialize the whole record first, so that it is written at once
+    std::vector<char> payload;
+    appendBytes(payload, key);
+    appendBytes(payload, entry.peak);
+    appendBytes(payload, entry.latest);
+    appendBytes(payload, uint32_t(entry.ops.size()));
+    for (auto idx : entry.ops) appendBytes(payload, idx);
+    std::vector<char> buf(std::begin(RECORD_MARK), std::end(RECORD_MARK));
+    appendBytes(buf, uint32_t(payload.size()));
+    appendBytes(buf, checksum(payload.data(), payload.size()));
+    buf.insert(buf.end(), payload.begin(), payload.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!entries.insert({key, entry}).second) return;
+    if (file == NO_FILE) return;
+    lockFile(file);
+    auto written = appendFile(file, buf);
+    unlockFile(file);
+    if (!written) LOG(WARNING) << "Cannot write to group schedule cache.";
+}
+
+size_t GroupCache::Size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+}  // namespace hmcos
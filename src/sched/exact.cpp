@@ -0,0 +1,323 @@
+#include <hmcos/sched/flat.hpp>
+#include <hmcos/sched/sched.hpp>
+#include <hmcos/util/bitset.hpp>
+#include <optional>
+#include <tuple>
+#include <unordered_set>
+
+namespace hmcos {
+
+/// Set of scheduled ops, with its Zobrist hash
+struct ExactStateKey {
+    SmallBitset sched;
+    uint64_t hash;
+
+    bool operator==(const ExactStateKey &other) const {
+        return this->hash == other.hash && this->sched == other.sched;
+    }
+};
+
+}  // namespace hmcos
+
+namespace std {
+
+template <>
+struct hash<hmcos::ExactStateKey> {
+    size_t operator()(const hmcos::ExactStateKey &key) const {
+        return key.hash;
+    }
+};
+
+}  // namespace std
+
+namespace hmcos {
+
+/// Depth-first branch-and-bound search of a schedule within a peak budget
+/// Ops and values are densely indexed, so that each step only updates arrays.
+/// Memory states follow `FlatGraph::EstimatePeak`: each killed value is freed
+/// once after its last consumer, even if that op uses it more than once.
+class ExactScheduler {
+public:
+    ExactScheduler(const FlatGraph &flat, const SchedOptions &opts)
+        : opts(opts),
+          flat(flat),
+          opInputs(flat.NumOps()),
+          consumers(flat.NumOps()),
+          ovlValue(flat.NumOps(), OVERLAP_FAILED),
+          zobrist(flat.NumOps()),
+          predCnt(flat.NumOps()),
+          sched(flat.NumOps()) {
+        // Count uses of each input by each op, and record consumers
+        for (auto i = 0u; i < flat.NumOps(); i++) {
+            for (auto k = flat.inBegin[i]; k < flat.inBegin[i + 1]; k++) {
+                auto v = flat.inputs[k];
+                auto it = std::find_if(opInputs[i].begin(), opInputs[i].end(),
+                                       [&](auto &use) { return use.first == v; });
+                if (it == opInputs[i].end())
+                    opInputs[i].push_back({v, 1});
+                else
+                    it->second++;
+                auto def = flat.defOp[v];
+                if (def != FlatGraph::NO_OP) {
+                    consumers[def].push_back(i);
+                    predCnt[i]++;
+                }
+            }
+
+            // The input is overlapped only if it is killed at its last
+            // occurrence in inputs of this op
+            auto ovlVal = flat.OverlapValue(i);
+            if (ovlVal == OVERLAP_FAILED) continue;
+            auto ovlEnd = flat.inputs.begin() + flat.inBegin[i + 1];
+            if (std::find(flat.inputs.begin() + flat.inBegin[i] +
+                              flat.overlap[i] + 1,
+                          ovlEnd, ovlVal) == ovlEnd)
+                ovlValue[i] = ovlVal;
+        }
+
+        // Initialize use counts and ready ops
+        useCnt.resize(flat.NumValues());
+        for (auto v = 0u; v < flat.nInputs; v++) useCnt[v] = flat.useCnt[v];
+        for (auto i = 0u; i < flat.NumOps(); i++)
+            if (predCnt[i] == 0) ready.push_back(i);
+        initMem = int64_t(flat.inputSize);
+        mem = initMem;
+
+        // Assign random keys to ops for Zobrist hashing. Use fixed seed so that
+        // search is reproducible across runs.
+        std::mt19937_64 rng(ZOBRIST_SEED);
+        for (auto &key : zobrist) key = rng();
+    }
+
+    /// Memory usage before any op is scheduled
+    int64_t InitMemory() const { return initMem; }
+
+    /// Search for a schedule whose peak is within `budget`. If it is not found,
+    /// `NextBudget()` is the lowest peak exceeding budget that is met during
+    /// search.
+    std::optional<std::vector<OpRef>> Search(int64_t budget) {
+        this->budget = budget;
+        nextBudget = INT64_MAX;
+        failed.clear();
+        if (!search()) return std::nullopt;
+        auto result = flat.Decompile(seq);
+        while (!trail.empty()) {
+            auto step = trail.back();
+            undo(step.op, step);
+        }
+        return result;
+    }
+
+    int64_t NextBudget() const { return nextBudget; }
+
+    /// Whether search stops because deadline is reached
+    bool Expired() const { return expired; }
+
+    /// Number of states visited in all searches
+    size_t NumStates() const { return nStates; }
+
+private:
+    static constexpr uint64_t ZOBRIST_SEED = 0x9e3779b97f4a7c15ull;
+    /// Deadline is checked once this number of states are visited
+    static constexpr size_t DEADLINE_CHECK_INTERVAL = 4096;
+    /// States proved infeasible are no longer recorded beyond this number
+    static constexpr size_t MAX_FAILED_STATES = 1 << 22;
+
+    /// Memory change of scheduling an op in current state, and its position in
+    /// ready list
+    struct Step {
+        uint32_t op;
+        int64_t inc, dec;
+        uint32_t readyPos = 0;
+        uint32_t nReady = 0;
+    };
+
+    Step evalOp(uint32_t u) const {
+        // Values are killed if this op is their last consumer. The output
+        // overlaps its input only if that input is killed.
+        int64_t dec = 0;
+        auto overlapped = false;
+        for (auto [v, count] : opInputs[u]) {
+            if (useCnt[v] != count) continue;
+            if (v == ovlValue[u])
+                overlapped = true;
+            else
+                dec += flat.valSize[v];
+        }
+        return {u, overlapped ? 0 : int64_t(flat.outSize[u]), dec};
+    }
+
+    void apply(Step &step) {
+        auto u = step.op;
+        mem += step.inc - step.dec;
+        for (auto [v, count] : opInputs[u]) useCnt[v] -= count;
+        for (auto k = flat.outBegin[u]; k < flat.outBegin[u + 1]; k++)
+            useCnt[flat.outputs[k]] = flat.useCnt[flat.outputs[k]];
+
+        // Update ready list
+        step.readyPos = uint32_t(
+            std::find(ready.begin(), ready.end(), u) - ready.begin());
+        ready[step.readyPos] = ready.back();
+        ready.pop_back();
+        step.nReady = 0;
+        for (auto succ : consumers[u])
+            if (--predCnt[succ] == 0) {
+                ready.push_back(succ);
+                step.nReady++;
+            }
+
+        sched.Set(u);
+        hash ^= zobrist[u];
+        seq.push_back(u);
+        trail.push_back(step);
+    }
+
+    void undo(uint32_t u, const Step &step) {
+        trail.pop_back();
+        seq.pop_back();
+        hash ^= zobrist[u];
+        sched.Reset(u);
+
+        // Restore ready list
+        ready.resize(ready.size() - step.nReady);
+        for (auto succ : consumers[u]) predCnt[succ]++;
+        if (step.readyPos == ready.size())
+            ready.push_back(u);
+        else {
+            ready.push_back(ready[step.readyPos]);
+            ready[step.readyPos] = u;
+        }
+
+        for (auto k = flat.outBegin[u]; k < flat.outBegin[u + 1]; k++)
+            useCnt[flat.outputs[k]] = 0;
+        for (auto [v, count] : opInputs[u]) useCnt[v] += count;
+        mem -= step.inc - step.dec;
+    }
+
+    bool search() {
+        // Check if all ops are scheduled
+        if (seq.size() == flat.NumOps()) return true;
+
+        // Check deadline
+        if (++nStates % DEADLINE_CHECK_INTERVAL == 0 &&
+            std::chrono::steady_clock::now() >= opts.deadline)
+            expired = true;
+        if (expired) return false;
+
+        // Skip states that are already proved infeasible
+        ExactStateKey key{sched, hash};
+        if (Contains(failed, key)) return false;
+
+        // Evaluate each ready op
+        auto steps = Transform<std::vector<Step>>(
+            ready, [&](uint32_t u) { return evalOp(u); });
+
+        // An op that does not increase memory after it finishes is scheduled
+        // right away without branching. Moving it to the front of any feasible
+        // schedule from this state lowers memory of all ops in between, so
+        // feasibility is preserved.
+        auto freeIt = std::find_if(steps.begin(), steps.end(), [&](auto &step) {
+            return step.inc <= step.dec && mem + step.inc <= budget;
+        });
+        if (freeIt != steps.end()) {
+            auto step = *freeIt;
+            apply(step);
+            if (search()) return true;
+            undo(step.op, step);
+            markFailed(std::move(key));
+            return false;
+        }
+
+        // Branch on ready ops, trying lower memory first
+        std::sort(steps.begin(), steps.end(), [&](auto &lhs, auto &rhs) {
+            return std::make_tuple(lhs.inc, lhs.inc - lhs.dec, lhs.op) <
+                   std::make_tuple(rhs.inc, rhs.inc - rhs.dec, rhs.op);
+        });
+        for (auto &step : steps) {
+            auto peak = mem + step.inc;
+            if (peak > budget) {
+                // Ops are sorted by increase, so later ones also exceed budget
+                nextBudget = std::min(nextBudget, peak);
+                break;
+            }
+            apply(step);
+            if (search()) return true;
+            undo(step.op, step);
+        }
+        markFailed(std::move(key));
+        return false;
+    }
+
+    void markFailed(ExactStateKey &&key) {
+        if (expired || failed.size() >= MAX_FAILED_STATES) return;
+        failed.insert(std::move(key));
+    }
+
+    const SchedOptions &opts;
+    const FlatGraph &flat;
+
+    /// Non-parameter inputs of each op, with number of uses by this op
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> opInputs;
+    /// Ops consuming outputs of each op, once for each use
+    std::vector<std::vector<uint32_t>> consumers;
+    /// Value that output of each op overlaps as `FlatGraph::EstimatePeak`
+    /// decides, or `OVERLAP_FAILED`
+    std::vector<uint32_t> ovlValue;
+    std::vector<uint64_t> zobrist;
+    /// Total size of graph inputs
+    int64_t initMem = 0;
+
+    /// State of search
+    std::vector<uint32_t> predCnt, useCnt, ready, seq;
+    std::vector<Step> trail;
+    SmallBitset sched;
+    uint64_t hash = 0;
+    int64_t mem = 0;
+
+    /// Budget of current search, and lowest peak exceeding it
+    int64_t budget = 0, nextBudget = INT64_MAX;
+    /// States from which no schedule fits in budget
+    std::unordered_set<ExactStateKey> failed;
+    size_t nStates = 0;
+    bool expired = false;
+};
+
+std::vector<OpRef> BranchAndBoundSchedule(const Graph &graph,
+                                          const SchedOptions &opts,
+                                          bool *proved) {
+    // Use reverse post-order schedule as the initial incumbent
+    FlatGraph flat(graph);
+    auto incumbent = ReversePostOrder(graph);
+    int64_t incPeak = flat.EstimatePeak(flat.Compile(incumbent));
+
+    // Start from the lower bound given by initial memory and op footprints
+    ExactScheduler scheduler(flat, opts);
+    auto budget = scheduler.InitMemory();
+    for (auto &op : graph.ops) budget = std::max(budget, OpFootprint(op));
+
+    // Deepen budget until a schedule is found. Budgets are raised to the lowest
+    // peak exceeding the last one, so the first schedule found is optimal.
+    auto optimal = false;
+    while (budget < incPeak) {
+        auto sched = scheduler.Search(budget);
+        if (scheduler.Expired()) {
+            LOG(INFO) << "Deadline is reached.";
+            break;
+        }
+        if (sched) {
+            incumbent = std::move(*sched);
+            incPeak = flat.EstimatePeak(flat.Compile(incumbent));
+            optimal = true;
+            break;
+        }
+        LOG(INFO) << fmt::format("No schedule within {} KB. {} states searched.",
+                                 budget / 1024, scheduler.NumStates());
+        budget = scheduler.NextBudget();
+    }
+    if (budget >= incPeak) optimal = true;
+
+    if (proved) *proved = optimal;
+    return incumbent;
+}
+
+}  // namespace hmcos
@@ -0,0 +1,118 @@
+#include <hmcos/sched/flat.hpp>
+
+namespace hmcos {
+
+FlatGraph::FlatGraph(const Graph &graph)
+    : ops(graph.ops), nInputs(uint32_t(graph.inputs.size())) {
+    // Number values
+    std::unordered_map<ValueRef, uint32_t> valIdx;
+    auto addValue = [&](const ValueRef &val, uint32_t def) {
+        valIdx.insert({val, uint32_t(values.size())});
+        values.push_back(val);
+        valSize.push_back(val->type.Size());
+        defOp.push_back(def);
+        useCnt.push_back(uint32_t(val->uses.size()));
+    };
+    for (auto &input : graph.inputs) {
+        addValue(input->value, NO_OP);
+        inputSize += input->value->type.Size();
+    }
+    for (auto [i, op] : EnumRange(ops)) {
+        opIdx.insert({op, uint32_t(i)});
+        for (auto &val : op->outputs) addValue(val, uint32_t(i));
+    }
+
+    // Store inputs and outputs of ops
+    inBegin.push_back(0);
+    outBegin.push_back(0);
+    for (auto &op : ops) {
+        auto ovlIdx = OverlapInput(op);
+        overlap.push_back(OVERLAP_FAILED);
+        for (auto [j, val] : EnumRange(op->inputs)) {
+            if (val->kind == ValueKind::PARAM) continue;
+            if (j == ovlIdx)
+                overlap.back() = uint32_t(inputs.size()) - inBegin.back();
+            inputs.push_back(valIdx.at(val));
+        }
+        inBegin.push_back(uint32_t(inputs.size()));
+        uint64_t size = 0;
+        for (auto &val : op->outputs) {
+            outputs.push_back(valIdx.at(val));
+            size += val->type.Size();
+        }
+        outBegin.push_back(uint32_t(outputs.size()));
+        outSize.push_back(size);
+        kinds.push_back(op->kind);
+    }
+
+    for (auto &output : graph.outputs)
+        graphOutputs.push_back(valIdx.at(output->value));
+}
+
+std::vector<uint32_t> FlatGraph::Compile(
+    const std::vector<OpRef> &seq) const {
+    return Transform<std::vector<uint32_t>>(
+        seq, [&](const OpRef &op) { return opIdx.at(op); });
+}
+
+std::vector<OpRef> FlatGraph::Decompile(
+    const std::vector<uint32_t> &seq) const {
+    return Transform<std::vector<OpRef>>(seq,
+                                         [&](uint32_t i) { return ops[i]; });
+}
+
+uint64_t FlatGraph::EstimatePeak(const std::vector<uint32_t> &seq) const {
+    auto cnt = useCnt;
+    uint64_t total = inputSize, peak = total;
+    std::vector<uint32_t> nextKill;
+    for (auto i : seq) {
+        // Generate outputs, and kill values left to this time
+        total += outSize[i];
+        for (auto v : nextKill) total -= valSize[v];
+        nextKill.clear();
+
+        // Kill values that are no longer used, either at this time if output
+        // overlaps it, or at next time
+        for (auto k = inBegin[i]; k < inBegin[i + 1]; k++) {
+            auto v = inputs[k];
+            if (--cnt[v] != 0) continue;
+            if (k - inBegin[i] == overlap[i])
+                total -= valSize[v];
+            else
+                nextKill.push_back(v);
+        }
+
+        peak = std::max(peak, total);
+    }
+    return peak;
+}
+
+LifetimeStat FlatGraph::ComputeLifetime(
+    const std::vector<uint32_t> &seq) const {
+    // Op sequence must be a full permutation of ops in graph
+    LOG_ASSERT(seq.size() == ops.size());
+
+    // Compute lifetime of values
+    auto cnt = useCnt;
+    std::vector<Lifetime> life(values.size());
+    for (auto v = 0u; v < values.size(); v++)
+        life[v] = {values[v], Lifetime::TIME_INPUT, Lifetime::TIME_UNKNOWN};
+    for (auto [t, i] : EnumRange(seq)) {
+        for (auto k = outBegin[i]; k < outBegin[i + 1]; k++)
+            life[outputs[k]].gen = int32_t(t);
+        for (auto k = inBegin[i]; k < inBegin[i + 1]; k++) {
+            auto v = inputs[k];
+            if (--cnt[v] != 0) continue;
+            life[v].kill = int32_t(k - inBegin[i] == overlap[i] ? t : t + 1);
+        }
+    }
+
+    // Finalize lifetime of outputs and sort lifetime
+    auto endTime = int32_t(seq.size());
+    for (auto v : graphOutputs) life[v].kill = endTime;
+    std::sort(life.begin(), life.end(), CmpByGenKill);
+
+    return {{Lifetime::TIME_INPUT, endTime}, std::move(life)};
+}
+
+}  // namespace hmcos
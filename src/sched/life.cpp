@@ -37,8 +37,7 @@ uint32_t OverlapInput(const OpRef &op) {
     auto &out = op->outputs[0];
 
     // Check if it is element-wise
-    if (!IsElementWise(op->type) && !IsReinterpret(op->type))
-        return OVERLAP_FAILED;
+    if (op->kind == OpKind::OTHER) return OVERLAP_FAILED;
 
     // The output value can only overlap the first input value with same size as
     // it
@@ -50,6 +49,19 @@ uint32_t OverlapInput(const OpRef &op) {
     return OVERLAP_FAILED;
 }
 
+int64_t OpFootprint(const OpRef &op) {
+    std::vector<ValueRef> inputs;
+    int64_t size = 0;
+    for (auto &val : op->inputs) {
+        if (val->kind == ValueKind::PARAM || Contains(inputs, val)) continue;
+        inputs.push_back(val);
+        size += val->type.Size();
+    }
+    if (OverlapInput(op) == OVERLAP_FAILED)
+        for (auto &val : op->outputs) size += val->type.Size();
+    return size;
+}
+
 LifetimeStat ComputeLifetime(const std::vector<OpRef> &opSeq,
                              const Graph &graph) {
     // Op sequence must be a full permutation of ops in graph
@@ -1,26 +1,29 @@
 #include <hmcos/sched/mem.hpp>
 #include <hmcos/sched/pass.hpp>
+#include <hmcos/util/flow.hpp>
 #include <hmcos/util/fmt.hpp>
 #include <hmcos/util/op.hpp>
 
 namespace hmcos {
 
-class JoinVisitor : public HierVertVisitor<Unit> {
+class SequenceJoiner {
 public:
-    JoinVisitor(HierGraph &hier) : hier(hier) {}
+    SequenceJoiner(HierGraph &hier) : hier(hier) {}
 
     void Join() {
-        for (auto &in : hier.inputs) Visit(in);
+        // Successors of a sequence are read after it is joined
+        auto roots = Transform<std::vector<HierVertRef>>(
+            hier.inputs, [](auto &in) { return HierVertRef(in); });
+        PreorderTraverse<SuccsOf>(roots, [&](const HierVertRef &vert) {
+            if (Is<Group>(vert))
+                LOG(FATAL) << "Cannot run `JoinSequencePass` on a hierarchical "
+                              "graph with groups.";
+            if (Is<Sequence>(vert)) joinSuccs(Cast<Sequence>(vert));
+        });
     }
 
-    Unit VisitInput(const HierInputRef &input) override {
-        for (auto &succ : input->succs) Visit(succ);
-        return {};
-    }
-
-    Unit VisitOutput(const HierOutputRef &output) override { return {}; }
-
-    Unit VisitSequence(const SequenceRef &seq) override {
+private:
+    void joinSuccs(const SequenceRef &seq) {
         // Initialize memory states
         auto cur = seq;
         MemStateVec states;
@@ -44,20 +47,6 @@ public:
             states.Append(inc, dec);
             join(cur, next);
         }
-
-        return visitSuccs(seq);
-    }
-
-    Unit VisitGroup(const GroupRef &group) override {
-        LOG(FATAL) << "Cannot run `JoinSequencePass` on a hierarchical graph "
-                      "with groups.";
-        return {};
-    }
-
-private:
-    Unit visitSuccs(const SequenceRef &seq) {
-        for (auto &succ : seq->succs) Visit(succ);
-        return {};
     }
 
     static std::pair<uint64_t, uint64_t> computeIncDec(const OpRef &op) {
@@ -87,46 +76,48 @@ private:
     HierGraph &hier;
 };
 
-void JoinSequencePass::Run(HierGraph &hier) { JoinVisitor(hier).Join(); }
+void JoinSequencePass::Run(HierGraph &hier) { SequenceJoiner(hier).Join(); }
 
-using HierListFunc =
-    std::function<std::vector<HierVertRef>(const HierVertRef &)>;
 using SeqPred = std::function<bool(const SequenceRef &)>;
 
-class SequenceDetector : public HierVertVisitor<bool> {
+/// Detect sequences reachable from a root sequence through neighbours `Nbrs`
+/// that all satisfy a predicate. Sequences with some neighbour not detected are
+/// added to frontier, and those with no neighbour detected are added to sink.
+template <class Nbrs>
+class SequenceDetector {
 public:
-    SequenceDetector(SeqPred inSet, HierListFunc getSuccs,
-                     std::unordered_set<SequenceRef> &set,
+    SequenceDetector(SeqPred inSet, std::unordered_set<SequenceRef> &set,
                      std::vector<SequenceRef> &frontier,
                      std::vector<SequenceRef> &sink)
-        : inSet(inSet),
-          getSuccs(getSuccs),
-          set(set),
-          frontier(frontier),
-          sink(sink) {}
-
-    bool VisitSequence(const SequenceRef &seq) override {
-        if (!inSet(seq)) return false;
-        set.insert(seq);
-        auto succs = getSuccs(seq);
-        bool isFrontier = false, isSink = true;
-        for (auto &succ : succs) {
-            auto notIn = !Visit(succ);
-            isFrontier |= notIn;
-            isSink &= notIn;
-        }
-        if (isFrontier) AddUnique(frontier, seq);
-        if (isSink) AddUnique(sink, seq);
-        return true;
+        : inSet(inSet), set(set), frontier(frontier), sink(sink) {}
+
+    void Detect(const SequenceRef &root) {
+        PostorderTraverse<Nbrs>(
+            HierVertRef(root),
+            [&](const HierVertRef &vert) {
+                if (!Is<Sequence>(vert)) return false;
+                auto seq = Cast<Sequence>(vert);
+                if (!inSet(seq)) return false;
+                set.insert(seq);
+                detected.Insert(*seq);
+                return true;
+            },
+            [&](const HierVertRef &vert) {
+                bool isFrontier = false, isSink = true;
+                for (auto &nbr : Nbrs::List(*vert)) {
+                    auto notIn = !detected.Contains(*NbrRef(nbr));
+                    isFrontier |= notIn;
+                    isSink &= notIn;
+                }
+                auto seq = Cast<Sequence>(vert);
+                if (isFrontier) AddUnique(frontier, seq);
+                if (isSink) AddUnique(sink, seq);
+            });
     }
 
-    bool VisitInput(const HierInputRef &) override { return false; }
-    bool VisitOutput(const HierOutputRef &) override { return false; }
-    bool VisitGroup(const GroupRef &) override { return false; }
-
 private:
     SeqPred inSet;
-    HierListFunc getSuccs;
+    VertSet detected;
     std::unordered_set<SequenceRef> &set;
     std::vector<SequenceRef> &frontier;
     std::vector<SequenceRef> &sink;
@@ -141,16 +132,18 @@ inline static void initOrInc(std::unordered_map<ValueRef, uint32_t> &map,
 }
 
 static std::vector<std::pair<ValueRef, uint32_t>> countConsumed(
-    const std::unordered_set<SequenceRef> &set,
+    const HierGraph &hier, const VertSet &members,
     const std::vector<SequenceRef> &inFront) {
     // Find all values consumed by input frontiers
     std::unordered_map<ValueRef, uint32_t> consumed;
     for (auto &seq : inFront) {
         for (auto &in : seq->inputs) {
             auto def = in->def.lock();
-            if (std::any_of(set.begin(), set.end(),
-                            [&](auto &seq) { return seq->Contains(def); }))
-                continue;
+            if (def) {
+                auto it = hier.opToSeq.find(def);
+                if (it != hier.opToSeq.end() && members.Contains(*it->second))
+                    continue;
+            }
             initOrInc(consumed, in);
         }
     }
@@ -180,69 +173,102 @@ static std::vector<std::pair<ValueRef, uint32_t>> countProduced(
     return vec;
 }
 
-static GroupRef createGroup(const std::unordered_set<SequenceRef> &set,
+static GroupRef createGroup(HierGraph &hier,
+                            const std::unordered_set<SequenceRef> &set,
                             const std::vector<SequenceRef> &inFront,
                             const std::vector<SequenceRef> &outFront,
                             const std::vector<SequenceRef> &entrs,
                             const std::vector<SequenceRef> &exits) {
     // Create group object
     auto group = std::make_shared<Group>();
+    group->id = hier.NewId();
 
     // Set fields of sequences
-    for (auto &seq : set) seq->group = group;
+    VertSet members;
+    for (auto &seq : set) {
+        seq->group = group;
+        members.Insert(*seq);
+    }
 
     // Set fields of the group
     group->seqs = std::vector(set.begin(), set.end());
     group->inFront = inFront;
     group->outFront = outFront;
-    group->consumed = countConsumed(set, inFront);
+    group->consumed = countConsumed(hier, members, inFront);
     group->produced = countProduced(set, outFront);
     group->entrs = entrs;
     group->exits = exits;
 
-    // Reconnnect vertices
+    // Reconnnect vertices. Each neighbour outside the group is rewired once,
+    // so the cost is linear in the number of edges crossing the group.
+    auto inGroup = [&](const HierVertRef &vert) {
+        return Is<Sequence>(vert) && members.Contains(*vert);
+    };
+    VertSet outPreds, outSuccs;
     for (auto &front : inFront) {
-        front->preds = Filter<decltype(front->preds)>(
-            front->preds, [&](const HierVertWeakRef &predWeak) {
-                auto pred = predWeak.lock();
-                if (group->Contains<Sequence>(pred))
-                    // keep this predecessor as it is in the group
-                    return true;
-                else {
-                    // connect this predcessor to the group instead of the
-                    // sequence
-                    HierVertex::ReplaceSuccOfPred(pred, front, group);
-                    AddUnique(group->preds, predWeak);
-                    return false;
-                }
+        RemoveIf(front->preds, [&](const HierVertWeakRef &predWeak) {
+            // keep this predecessor as it is in the group
+            auto pred = predWeak.lock();
+            if (inGroup(pred)) return false;
+            if (!outPreds.Insert(*pred)) return true;
+
+            // connect this predcessor to the group instead of the sequences
+            bool added = false;
+            RemoveIf(pred->succs, [&](const HierVertRef &succ) {
+                if (!inGroup(succ)) return false;
+                if (added) return true;
+                added = true;
+                return false;
             });
+            std::replace_if(pred->succs.begin(), pred->succs.end(), inGroup,
+                            HierVertRef(group));
+            group->preds.push_back(predWeak);
+            return true;
+        });
     }
 
     for (auto &front : outFront) {
-        front->succs = Filter<decltype(front->succs)>(
-            front->succs, [&](const HierVertRef &succ) {
-                if (group->Contains<Sequence>(succ))
-                    return true;
-                else {
-                    HierVertex::ReplacePredOfSucc(succ, front, group);
-                    AddUnique(group->succs, succ);
-                    return false;
-                }
+        RemoveIf(front->succs, [&](const HierVertRef &succ) {
+            if (inGroup(succ)) return false;
+            if (!outSuccs.Insert(*succ)) return true;
+            bool added = false;
+            RemoveIf(succ->preds, [&](const HierVertWeakRef &predWeak) {
+                if (!inGroup(predWeak.lock())) return false;
+                if (added) return true;
+                added = true;
+                return false;
             });
+            std::replace_if(
+                succ->preds.begin(), succ->preds.end(),
+                [&](const HierVertWeakRef &pred) {
+                    return inGroup(pred.lock());
+                },
+                HierVertWeakRef(group));
+            group->succs.push_back(succ);
+            return true;
+        });
     }
 
     return group;
 }
 
-/// Use DP to find a subset of intruded sequences which minimize size of its
-/// outputs.
+/// Find a subset of intruded sequences which minimize size of its outputs.
+/// A valid subset contains the root and is closed under predecessors. Its
+/// output size is the total size of sequences with successors outside it.
+/// This is solved exactly as a minimum cut, whose source side is the subset.
+/// Among all subsets of minimum size, the largest one is chosen. The
+/// exhaustive search is kept as a fallback for degenerate cases, and is
+/// bounded in number of visited subsets.
 class OutputSizeOptimizer {
 public:
     OutputSizeOptimizer(const std::unordered_set<SequenceRef> &allSeqs,
                         const SequenceRef &root)
         : allSeqs(allSeqs), root(root) {}
 
-    std::vector<SequenceRef> Optimize() {
+    std::unordered_set<SequenceRef> Optimize() {
+        auto result = cut();
+        if (!result.empty()) return result;
+
         // Build predecessor count map
         std::unordered_map<SequenceRef, uint32_t> predCount;
         for (auto &seq : allSeqs)
@@ -253,17 +279,74 @@ public:
         std::vector<SequenceRef> chosen;
         std::unordered_map<SequenceRef, uint32_t> succCount;
         minSize = UINT64_MAX;
+        budget = SEARCH_LIMIT;
         search(chosen, predCount, succCount);
 
-        return bestSet;
+        return {bestSet.begin(), bestSet.end()};
     }
 
 private:
+    static constexpr uint64_t INF = UINT64_MAX / 4;
+    static constexpr size_t SEARCH_LIMIT = 1 << 12;
+
+    /// Solve the problem with minimum cut. Returns empty set if the minimum
+    /// output size is zero, which the search does not accept.
+    std::unordered_set<SequenceRef> cut() {
+        // Index sequences, root first
+        std::vector<SequenceRef> seqs{root};
+        std::unordered_map<SequenceRef, uint32_t> index{{root, 0}};
+        for (auto &seq : allSeqs) {
+            if (seq == root) continue;
+            index.insert({seq, uint32_t(seqs.size())});
+            seqs.push_back(seq);
+        }
+        auto indexOf = [&](const HierVertRef &vert) {
+            if (!Is<Sequence>(vert)) return UINT32_MAX;
+            auto it = index.find(Cast<Sequence>(vert));
+            return it == index.end() ? UINT32_MAX : it->second;
+        };
+
+        // Build flow network. Sequence `i` is split into node `i` and its
+        // output node `n + i`. Cutting the edge between them pays its output
+        // size. Infinite edges keep the source side closed under predecessors.
+        auto n = uint32_t(seqs.size()), src = 2 * n, sink = 2 * n + 1;
+        FlowNetwork net(2 * n + 2);
+        net.AddEdge(src, 0, INF);
+        for (auto i = 0u; i < n; i++) {
+            auto &seq = seqs[i];
+            net.AddEdge(i, n + i,
+                        std::transform_reduce(
+                            seq->outputs.begin(), seq->outputs.end(), 0ull,
+                            std::plus(), [](const ValueRef &val) {
+                                return val->type.Size();
+                            }));
+            for (auto &succ : seq->succs) {
+                auto j = indexOf(succ);
+                net.AddEdge(n + i, j == UINT32_MAX ? sink : j, INF);
+            }
+            if (i == 0) continue;
+            for (auto &pred : seq->preds) {
+                auto j = indexOf(pred.lock());
+                net.AddEdge(i, j == UINT32_MAX ? sink : j, INF);
+            }
+        }
+
+        // Take the largest source side of all minimum cuts
+        auto flow = net.MaxFlow(src, sink);
+        if (flow == 0 || flow >= INF) return {};
+        auto toSink = net.ReachSink(sink);
+        std::unordered_set<SequenceRef> result;
+        for (auto i = 0u; i < n; i++)
+            if (!toSink[i]) result.insert(seqs[i]);
+        return result;
+    }
+
     void search(std::vector<SequenceRef> &chosen,
                 std::unordered_map<SequenceRef, uint32_t> &predCount,
                 std::unordered_map<SequenceRef, uint32_t> &succCount) {
         // Check if this set has been searched before
-        if (Contains(memo, chosen)) return;
+        if (budget == 0 || Contains(memo, chosen)) return;
+        budget--;
 
         // Compute size of output frontier
         uint64_t size = 0;
@@ -329,6 +412,7 @@ private:
     std::unordered_map<std::vector<SequenceRef>, uint64_t> memo;
     std::vector<SequenceRef> bestSet;
     uint64_t minSize;
+    size_t budget;
 };
 
 bool MakeGroupPass::makeCell = true;
@@ -336,26 +420,33 @@ bool MakeGroupPass::makeCell = true;
 std::function<bool(const SequenceRef &)> MakeGroupPass::isCellOut =
     [](auto &seq) { return seq->ops.front()->type == "Concat"; };
 
-inline static void makeGroupFromCell(const SequenceRef &cellOut) {
+inline static void makeGroupFromCell(HierGraph &hier,
+                                     const SequenceRef &cellOut) {
+    auto &dom = *hier.dom, &postDom = *hier.postDom;
+
     // Detect input frontier of the group
     std::unordered_set<SequenceRef> seqs;
     std::vector<SequenceRef> cellInFront, cellEntrs;
-    SequenceDetector(
-        [&](const SequenceRef &seq) { return cellOut->PostDominates(*seq); },
-        std::mem_fn(&HierVertex::Preds), seqs, cellInFront, cellEntrs)
-        .Visit(cellOut);
+    SequenceDetector<PredsOf>(
+        [&](const SequenceRef &seq) {
+            return postDom.Dominates(cellOut->id, seq->id);
+        },
+        seqs, cellInFront, cellEntrs)
+        .Detect(cellOut);
 
     // Detect output frontier of the group by intruding on other cells
     std::unordered_set<SequenceRef> intruded;
     std::vector<SequenceRef> intrOutFront, intrExits;
-    SequenceDetector(
-        [&](const SequenceRef &seq) { return cellOut->Dominates(*seq); },
-        std::mem_fn(&HierVertex::Succs), intruded, intrOutFront, intrExits)
-        .Visit(cellOut);
+    SequenceDetector<SuccsOf>(
+        [&](const SequenceRef &seq) {
+            return dom.Dominates(cellOut->id, seq->id);
+        },
+        intruded, intrOutFront, intrExits)
+        .Detect(cellOut);
 
     // Directly create group if making cells is not required or not possible
     if (!MakeGroupPass::makeCell || Contains(intrOutFront, cellOut)) {
-        createGroup(seqs, cellInFront, {cellOut}, cellEntrs, {cellOut});
+        createGroup(hier, seqs, cellInFront, {cellOut}, cellEntrs, {cellOut});
         return;
     }
 
@@ -363,7 +454,7 @@ inline static void makeGroupFromCell(const SequenceRef &cellOut) {
     // sizes
     auto minSizeSet = OutputSizeOptimizer(intruded, cellOut).Optimize();
     if (minSizeSet.size() <= 2) {  // don't intrude if the subset is trivial
-        createGroup(seqs, cellInFront, {cellOut}, cellEntrs, {cellOut});
+        createGroup(hier, seqs, cellInFront, {cellOut}, cellEntrs, {cellOut});
         return;
     }
 
@@ -371,10 +462,10 @@ inline static void makeGroupFromCell(const SequenceRef &cellOut) {
     intruded.clear();
     intrOutFront.clear();
     intrExits.clear();
-    SequenceDetector(
+    SequenceDetector<SuccsOf>(
         [&](const SequenceRef &seq) { return Contains(minSizeSet, seq); },
-        std::mem_fn(&HierVertex::Succs), intruded, intrOutFront, intrExits)
-        .Visit(cellOut);
+        intruded, intrOutFront, intrExits)
+        .Detect(cellOut);
     intruded.erase(cellOut);
 
     // Find input frontier and entrance of intruded sequences
@@ -391,12 +482,13 @@ inline static void makeGroupFromCell(const SequenceRef &cellOut) {
     }
 
     // Create cell group and intruded group
-    createGroup(seqs, cellInFront, {cellOut}, cellEntrs, {cellOut});
-    createGroup(intruded, intrInFront, intrOutFront, intrEntrs, intrExits);
+    createGroup(hier, seqs, cellInFront, {cellOut}, cellEntrs, {cellOut});
+    createGroup(hier, intruded, intrInFront, intrOutFront, intrEntrs,
+                intrExits);
 }
 
 void MakeGroupPass::Run(HierGraph &hier) {
-    // Build dominator tree
+    // Build dominator tree, unless it is given
     if (hier.inputs.empty()) {
         LOG(ERROR) << "Input list of the hierarchical graph is empty.";
         return;
@@ -404,10 +496,11 @@ void MakeGroupPass::Run(HierGraph &hier) {
     if (hier.inputs.size() > 1)
         LOG(WARNING)
             << "Dominator tree will only be built for the first input vertex.";
-    auto domNodes = DomBuilder<HierVertex>().Build(hier.inputs[0]);
-    for (auto &node : domNodes) node->vertex.lock()->dom = node;
+    if (!hier.dom)
+        hier.dom = std::make_shared<DomTree>(
+            DomTree::Build(HierVertRef(hier.inputs[0])));
 
-    // Build post-dominator tree
+    // Build post-dominator tree, unless it is given
     if (hier.outputs.empty()) {
         LOG(ERROR) << "Output list of the hierarchical graph is empty.";
         return;
@@ -415,10 +508,9 @@ void MakeGroupPass::Run(HierGraph &hier) {
     if (hier.outputs.size() > 1)
         LOG(WARNING) << "Post-dominator tree will only be built for the first "
                         "output vertex.";
-    auto postDomNodes = DomBuilder<HierVertex>(std::mem_fn(&HierVertex::Succs),
-                                               std::mem_fn(&HierVertex::Preds))
-                            .Build(hier.outputs[0]);
-    for (auto &node : postDomNodes) node->vertex.lock()->postDom = node;
+    if (!hier.postDom)
+        hier.postDom = std::make_shared<DomTree>(
+            DomTree::Build<SuccsOf, PredsOf>(HierVertRef(hier.outputs[0])));
 
     // Find all cell outputs in reverse post-order, also backup predecessors and
     // successors
@@ -433,7 +525,7 @@ void MakeGroupPass::Run(HierGraph &hier) {
     // Build group from cells
     for (auto &out : cellOuts) {
         if (out->group.lock()) continue;
-        makeGroupFromCell(out);
+        makeGroupFromCell(hier, out);
     }
 }
 
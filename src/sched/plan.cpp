@@ -1,7 +1,9 @@
 #include <filesystem>
 #include <fstream>
 #include <hmcos/sched/plan.hpp>
+#include <hmcos/util/parallel.hpp>
 #include <hmcos/util/viz.hpp>
+#include <queue>
 
 namespace hmcos {
 
@@ -13,8 +15,8 @@ uint64_t Container::Place(int32_t begin, int32_t width, uint64_t height) {
                                   tEnd - width, begin);
         return false;
     }
-    auto idx = findStepAt(begin);
-    auto step = steps[idx];
+    auto it = findStepAt(begin);
+    auto step = it->second;
 
     // Check if the item can be placed at this step
     if (end > step.End()) {
@@ -29,18 +31,15 @@ uint64_t Container::Place(int32_t begin, int32_t width, uint64_t height) {
     maxHeight = std::max(maxHeight, newHeight);
 
     // Place this item by modifying current steps
-    steps.erase(steps.begin() + idx);
-    std::vector<Step> inserted;
+    eraseStep(it);
     if (begin != step.begin)  // gap on left fringe
-        inserted.push_back({step.begin, begin - step.begin, step.offset});
-    inserted.push_back({begin, width, newHeight});
+        insertStep({step.begin, begin - step.begin, step.offset});
+    auto placed = insertStep({begin, width, newHeight});
     if (end != step.End())  // gap on right fringe
-        inserted.push_back({end, step.End() - end, step.offset});
-    steps.insert(steps.begin() + idx, inserted.begin(), inserted.end());
+        insertStep({end, step.End() - end, step.offset});
 
     /// Merge steps that have same offsets to one step
-    auto beginIdx = std::max(idx - 1, 0);
-    tryMerge(beginIdx, uint32_t(inserted.size() + 1));
+    mergeAround(placed);
 
     return step.offset;
 }
@@ -52,63 +51,262 @@ void Container::Lift(int32_t time) {
         return;
     }
 
-    // Find step
-    auto idx = findStepAt(time);
-    auto &step = steps[idx];
+    // Find lowest neighbor of the step
+    auto it = findStepAt(time);
+    auto step = it->second;
+    auto nbrOff = UINT64_MAX;
+    if (it != steps.begin()) nbrOff = std::prev(it)->second.offset;
+    if (auto next = std::next(it); next != steps.end())
+        nbrOff = std::min(nbrOff, next->second.offset);
+    if (step.offset > nbrOff) {
+        LOG(ERROR) << fmt::format("Step {} is higher than its neighbors.",
+                                  step.Format());
+        return;
+    }
 
     // Lift step to its lowest neighbor
-    if (idx == 0) {
-        auto &rightStep = steps[1];
-        if (step.offset > rightStep.offset) {
-            LOG(ERROR) << fmt::format("Step {} is higher than step {}.",
-                                      step.Format(), rightStep.Format());
-            return;
+    eraseStep(it);
+    step.offset = nbrOff;
+    mergeAround(insertStep(step));
+}
+
+inline Container::StepIter Container::findStepAt(int32_t time) {
+    LOG_ASSERT(time >= tBegin && time < tEnd);
+    return std::prev(steps.upper_bound(time));
+}
+
+Container::StepIter Container::insertStep(const Step &step) {
+    lowest.insert({step.offset, step.begin});
+    return steps.insert({step.begin, step}).first;
+}
+
+void Container::eraseStep(StepIter it) {
+    lowest.erase({it->second.offset, it->first});
+    steps.erase(it);
+}
+
+void Container::mergeAround(StepIter it) {
+    // Merge into previous step, which keeps its beginning time
+    if (it != steps.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second.offset == it->second.offset) {
+            prev->second.width += it->second.width;
+            eraseStep(it);
+            it = prev;
         }
-        step.offset = rightStep.offset;
-        tryMerge(idx, 1);
-    } else if (idx == int32_t(steps.size()) - 1) {
-        auto &leftStep = steps[idx - 1];
-        if (step.offset > leftStep.offset) {
-            LOG(ERROR) << fmt::format("Step {} is higher than step {}.",
-                                      step.Format(), leftStep.Format());
-            return;
+    }
+
+    // Merge next step into this one
+    auto next = std::next(it);
+    if (next != steps.end() && next->second.offset == it->second.offset) {
+        it->second.width += next->second.width;
+        eraseStep(next);
+    }
+}
+
+BlockIndex::BlockIndex(const std::vector<MemoryDesc> &descs)
+    : descs(descs), leafOf(descs.size()), nodes(2 * descs.size()) {
+    // Sort blocks by generation time
+    auto n = uint32_t(descs.size());
+    std::vector<uint32_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](auto lhs, auto rhs) {
+        return descs[lhs].gen < descs[rhs].gen;
+    });
+    gens.reserve(n);
+    for (auto i = 0u; i < n; i++) {
+        auto idx = order[i];
+        gens.push_back(descs[idx].gen);
+        leafOf[idx] = i;
+        nodes[n + i].kills = {{descs[idx].kill, idx}};
+    }
+
+    // Merge sorted kill times from leaves to root
+    for (auto v = n; v-- > 1;) {
+        auto &lhs = nodes[2 * v].kills, &rhs = nodes[2 * v + 1].kills;
+        auto &kills = nodes[v].kills;
+        kills.resize(lhs.size() + rhs.size());
+        std::merge(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                   kills.begin());
+    }
+
+    // Build segment trees of best fit blocks
+    for (auto v = 1u; v < 2 * n; v++) {
+        auto &[kills, best] = nodes[v];
+        auto m = kills.size();
+        best.resize(2 * m);
+        for (auto j = 0u; j < m; j++) best[m + j] = kills[j].second;
+        for (auto j = m - 1; j >= 1; j--)
+            best[j] = pick(best[2 * j], best[2 * j + 1]);
+    }
+}
+
+uint32_t BlockIndex::BestFit(int32_t begin, int32_t end) const {
+    auto n = gens.size();
+    auto l = std::lower_bound(gens.begin(), gens.end(), begin) - gens.begin(),
+         r = std::upper_bound(gens.begin(), gens.end(), end) - gens.begin();
+    uint32_t best = NONE;
+    auto query = [&](const Node &node) {
+        // Only blocks killed no later than `end` can fit
+        auto m = node.kills.size();
+        auto p = std::upper_bound(node.kills.begin(), node.kills.end(),
+                                  std::pair(end, NONE)) -
+                 node.kills.begin();
+        for (auto i = m, j = m + p; i < j; i >>= 1, j >>= 1) {
+            if (i & 1) best = pick(best, node.best[i++]);
+            if (j & 1) best = pick(best, node.best[--j]);
         }
-        step.offset = leftStep.offset;
-        tryMerge(idx - 1, 1);
+    };
+    for (l += n, r += n; l < r; l >>= 1, r >>= 1) {
+        if (l & 1) query(nodes[l++]);
+        if (r & 1) query(nodes[--r]);
+    }
+    return best;
+}
+
+void BlockIndex::Remove(uint32_t idx) {
+    auto key = std::pair(descs[idx].kill, idx);
+    for (auto v = gens.size() + leafOf[idx]; v >= 1; v >>= 1) {
+        auto &[kills, best] = nodes[v];
+        auto j = kills.size() +
+                 (std::lower_bound(kills.begin(), kills.end(), key) -
+                  kills.begin());
+        best[j] = NONE;
+        for (j >>= 1; j >= 1; j >>= 1)
+            best[j] = pick(best[2 * j], best[2 * j + 1]);
+    }
+}
+
+uint32_t BlockIndex::pick(uint32_t lhs, uint32_t rhs) const {
+    if (lhs == NONE) return rhs;
+    if (rhs == NONE) return lhs;
+    auto &l = descs[lhs], &r = descs[rhs];
+    if (CmpByLengthInv(l, r)) return lhs;
+    if (CmpByLengthInv(r, l)) return rhs;
+    return std::min(lhs, rhs);
+}
+
+uint64_t GapIndex::Allocate(uint64_t size) {
+    // Find the lowest gap that fits, or allocate above all blocks
+    auto t = root;
+    while (t != NIL && nodes[t].maxSize >= size) {
+        auto &node = nodes[t];
+        if (nodes[node.left].maxSize >= size)
+            t = node.left;
+        else if (node.size >= size)
+            break;
+        else
+            t = node.right;
+    }
+    if (t == NIL || nodes[t].maxSize < size) {
+        auto offset = top;
+        top += size;
+        return offset;
+    }
+
+    // Shrink the gap from its lower end
+    auto [offset, gapSize] = std::pair(nodes[t].offset, nodes[t].size);
+    erase(offset);
+    if (gapSize > size) insert(offset + size, gapSize - size);
+    return offset;
+}
+
+void GapIndex::Free(uint64_t offset, uint64_t size) {
+    auto begin = offset, end = offset + size;
+    if (auto prev = lower(begin);
+        prev != NIL && nodes[prev].offset + nodes[prev].size == begin) {
+        begin = nodes[prev].offset;
+        erase(begin);
+    }
+    if (end == top) {
+        top = begin;
+        return;
+    }
+    if (auto next = find(end); next != NIL) {
+        auto nextEnd = end + nodes[next].size;
+        erase(end);
+        end = nextEnd;
+    }
+    insert(begin, end - begin);
+}
+
+void GapIndex::update(uint32_t t) {
+    auto &node = nodes[t];
+    node.maxSize = std::max(
+        {node.size, nodes[node.left].maxSize, nodes[node.right].maxSize});
+}
+
+std::pair<uint32_t, uint32_t> GapIndex::split(uint32_t t, uint64_t offset) {
+    if (t == NIL) return {NIL, NIL};
+    if (nodes[t].offset < offset) {
+        auto [lhs, rhs] = split(nodes[t].right, offset);
+        nodes[t].right = lhs;
+        update(t);
+        return {t, rhs};
     } else {
-        auto &leftStep = steps[idx - 1], &rightStep = steps[idx + 1];
-        if (step.offset > leftStep.offset || step.offset > rightStep.offset) {
-            LOG(ERROR) << fmt::format(
-                "Step {} is higher than step {} or step {}.", step.Format(),
-                leftStep.Format(), rightStep.Format());
-            return;
-        }
-        step.offset = std::min(leftStep.offset, rightStep.offset);
-        tryMerge(idx - 1, 2);
+        auto [lhs, rhs] = split(nodes[t].left, offset);
+        nodes[t].left = rhs;
+        update(t);
+        return {lhs, t};
     }
 }
 
-inline int32_t Container::findStepAt(int32_t time) const {
-    LOG_ASSERT(time >= tBegin && time < tEnd);
-    auto next = std::upper_bound(steps.begin(), steps.end(), Step{time, 0, 0},
-                                 CmpByBegin);
-    return int32_t(next - steps.begin()) - 1;
-}
-
-void Container::tryMerge(size_t beginIdx, uint32_t nTrial) {
-    auto stepIdx = beginIdx;
-    for (auto i = 0u; i < nTrial; i++) {
-        // No steps behind, cannot merge further
-        if (stepIdx == steps.size() - 1) return;
-
-        // Merge two steps if they have same offsets
-        auto curStep = &steps[stepIdx], nextStep = &steps[stepIdx + 1];
-        if (curStep->offset == nextStep->offset) {
-            curStep->width += nextStep->width;
-            steps.erase(steps.begin() + stepIdx + 1);
+uint32_t GapIndex::merge(uint32_t lhs, uint32_t rhs) {
+    if (lhs == NIL) return rhs;
+    if (rhs == NIL) return lhs;
+    if (nodes[lhs].prio > nodes[rhs].prio) {
+        nodes[lhs].right = merge(nodes[lhs].right, rhs);
+        update(lhs);
+        return lhs;
+    } else {
+        nodes[rhs].left = merge(lhs, nodes[rhs].left);
+        update(rhs);
+        return rhs;
+    }
+}
+
+void GapIndex::insert(uint64_t offset, uint64_t size) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    Node node{offset, size, size, seed, NIL, NIL};
+    uint32_t t;
+    if (freeNodes.empty()) {
+        t = uint32_t(nodes.size());
+        nodes.push_back(node);
+    } else {
+        t = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[t] = node;
+    }
+    auto [lhs, rhs] = split(root, offset);
+    root = merge(merge(lhs, t), rhs);
+}
+
+void GapIndex::erase(uint64_t offset) {
+    auto [lhs, rest] = split(root, offset);
+    auto [mid, rhs] = split(rest, offset + 1);
+    if (mid != NIL) freeNodes.push_back(mid);
+    root = merge(lhs, rhs);
+}
+
+uint32_t GapIndex::lower(uint64_t offset) const {
+    uint32_t result = NIL;
+    for (auto t = root; t != NIL;) {
+        if (nodes[t].offset < offset) {
+            result = t;
+            t = nodes[t].right;
         } else
-            stepIdx++;
+            t = nodes[t].left;
     }
+    return result;
+}
+
+uint32_t GapIndex::find(uint64_t offset) const {
+    auto t = root;
+    while (t != NIL && nodes[t].offset != offset)
+        t = offset < nodes[t].offset ? nodes[t].left : nodes[t].right;
+    return t;
 }
 
 MemoryPlan::MemoryPlan(uint64_t peak, std::vector<MemoryDesc> &&descs)
@@ -146,37 +344,234 @@ void MemoryPlan::Plot(const std::string &dir, const std::string &name,
     plot.Render(dir, format);
 }
 
-MemoryPlan BestFit(const LifetimeStat &stat) {
-    // Initialize unplaced memory descriptors and container
-    auto unplaced = Transform<std::vector<MemoryDesc>>(
-        stat.values, [](auto &lt) { return MemoryDesc(lt); });
-    Container cont(stat.range.first, stat.range.second);
+static MemoryPlan bestFit(std::vector<MemoryDesc> &&blocks,
+                          std::pair<int32_t, int32_t> range) {
+    // Initialize index of unplaced blocks and container
+    BlockIndex unplaced(blocks);
+    Container cont(range.first, range.second);
 
     // Iterate until no blocks remain
     std::vector<MemoryDesc> placed;
-    while (!unplaced.empty()) {
+    while (placed.size() < blocks.size()) {
         // Choose step with lowest offset
-        auto &step = cont.FindMinBy(CmpByOffset);
+        auto &step = cont.Lowest();
 
         // Find best fit for this step
-        auto bestFitPos = MinPosWithConstr(
-            unplaced, [&](auto &desc) { return step.CanPlace(desc); },
-            CmpByLengthInv);
+        auto bestFit = unplaced.BestFit(step.begin, step.End());
 
         // Lift this step if no block can be placed
-        if (!bestFitPos.has_value()) {
+        if (bestFit == BlockIndex::NONE) {
             cont.Lift(step.begin);
             continue;
         }
 
         // Place best fit block at the step
-        auto block = *bestFitPos.value();
+        auto block = blocks[bestFit];
         block.offset = cont.Place(block.gen, block.Length(), block.size);
         placed.push_back(std::move(block));
-        unplaced.erase(bestFitPos.value());
+        unplaced.Remove(bestFit);
     }
 
     return MemoryPlan(cont.GetMaxHeight(), std::move(placed));
 }
 
-}  // namespace hmcos
\ No newline at end of file
+MemoryPlan BestFit(const LifetimeStat &stat) {
+    return bestFit(Transform<std::vector<MemoryDesc>>(
+                       stat.values, [](auto &lt) { return MemoryDesc(lt); }),
+                   stat.range);
+}
+
+/// Placed block, with fields needed in gap search stored inline
+struct PlacedBlock {
+    uint64_t offset, size;
+    int32_t gen, kill;
+    uint32_t idx;
+
+    bool operator<(const PlacedBlock &other) const {
+        return offset < other.offset;
+    }
+};
+
+/// Placed blocks, ordered by offset and then by time of placement
+using PlacedVec = std::vector<PlacedBlock>;
+
+/// Find offset of the tightest gap among placed blocks that overlap `desc` in
+/// time. If no gap fits, the block is placed above all of them.
+static uint64_t findGap(const PlacedVec &placed, const MemoryDesc &desc) {
+    uint64_t cur = 0, bestOff = MemoryDesc::OFFSET_UNKNOWN, bestGap = UINT64_MAX;
+    for (auto &other : placed) {
+        if (other.kill <= desc.gen || other.gen >= desc.kill) continue;
+        if (cur + desc.size <= other.offset && other.offset - cur < bestGap) {
+            bestOff = cur;
+            bestGap = other.offset - cur;
+        }
+        cur = std::max(cur, other.offset + other.size);
+    }
+    return bestOff == MemoryDesc::OFFSET_UNKNOWN ? cur : bestOff;
+}
+
+/// Place a block with `findGap` and add it to placed blocks
+static void placeBlock(PlacedVec &placed, MemoryDesc &desc, uint32_t idx) {
+    if (desc.size == 0) {
+        desc.offset = 0;
+        return;
+    }
+    desc.offset = findGap(placed, desc);
+    PlacedBlock block{desc.offset, desc.size, desc.gen, desc.kill, idx};
+    placed.insert(std::upper_bound(placed.begin(), placed.end(), block),
+                  block);
+}
+
+/// Place blocks one by one in given order with `findGap`
+static void placeInOrder(std::vector<MemoryDesc> &blocks,
+                         const std::vector<uint32_t> &order) {
+    PlacedVec placed;
+    for (auto idx : order)
+        if (blocks[idx].offset == MemoryDesc::OFFSET_UNKNOWN)
+            placeBlock(placed, blocks[idx], idx);
+}
+
+static void greedyBySize(std::vector<MemoryDesc> &blocks) {
+    std::vector<uint32_t> order(blocks.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](auto lhs, auto rhs) {
+        return blocks[lhs].size > blocks[rhs].size;
+    });
+    placeInOrder(blocks, order);
+}
+
+static void greedyByBreadth(std::vector<MemoryDesc> &blocks,
+                            std::pair<int32_t, int32_t> range) {
+    // Compute total size of alive blocks at each time step
+    auto nSteps = size_t(range.second - range.first);
+    std::vector<int64_t> breadth(nSteps + 1, 0);
+    for (auto &desc : blocks) {
+        breadth[desc.gen - range.first] += desc.size;
+        breadth[desc.kill - range.first] -= desc.size;
+    }
+    std::partial_sum(breadth.begin(), breadth.end(), breadth.begin());
+
+    // Rank steps so that wider steps are visited first
+    std::vector<uint32_t> steps(nSteps), rank(nSteps);
+    std::iota(steps.begin(), steps.end(), 0);
+    std::stable_sort(steps.begin(), steps.end(), [&](auto lhs, auto rhs) {
+        return breadth[lhs] > breadth[rhs];
+    });
+    for (auto [i, t] : EnumRange(steps)) rank[t] = uint32_t(i);
+
+    // Build sparse table of minimal ranks over ranges of steps
+    std::vector<std::vector<uint32_t>> minRank{rank};
+    for (size_t w = 1; 2 * w <= nSteps; w *= 2) {
+        auto &prev = minRank.back();
+        std::vector<uint32_t> next(nSteps - 2 * w + 1);
+        for (auto i = 0u; i < next.size(); i++)
+            next[i] = std::min(prev[i], prev[i + w]);
+        minRank.push_back(std::move(next));
+    }
+
+    // Each block is placed when its widest step is visited. Blocks visited at
+    // the same step are placed in decreasing order of size.
+    std::vector<uint32_t> first(blocks.size(), UINT32_MAX), order;
+    for (auto [idx, desc] : EnumRange(blocks)) {
+        if (desc.gen >= desc.kill) {  // never alive
+            desc.offset = 0;
+            continue;
+        }
+        auto l = size_t(desc.gen - range.first), len = size_t(desc.Length());
+        auto k = 0u;
+        while ((size_t(2) << k) <= len) k++;
+        first[idx] =
+            std::min(minRank[k][l], minRank[k][l + len - (size_t(1) << k)]);
+        order.push_back(uint32_t(idx));
+    }
+    std::sort(order.begin(), order.end(), [&](auto lhs, auto rhs) {
+        if (first[lhs] != first[rhs]) return first[lhs] < first[rhs];
+        if (blocks[lhs].size != blocks[rhs].size)
+            return blocks[lhs].size > blocks[rhs].size;
+        return lhs < rhs;
+    });
+    placeInOrder(blocks, order);
+}
+
+static void firstFit(std::vector<MemoryDesc> &blocks) {
+    // Sweep blocks in order of generation. Blocks killed before the current
+    // one is generated are freed, so all allocated blocks overlap the current
+    // one in time.
+    std::vector<uint32_t> order(blocks.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](auto lhs, auto rhs) {
+        return blocks[lhs].gen < blocks[rhs].gen;
+    });
+    GapIndex gaps;
+    std::priority_queue<std::pair<int32_t, uint32_t>,
+                        std::vector<std::pair<int32_t, uint32_t>>,
+                        std::greater<>>
+        kills;
+    for (auto idx : order) {
+        auto &desc = blocks[idx];
+        while (!kills.empty() && kills.top().first <= desc.gen) {
+            auto &killed = blocks[kills.top().second];
+            gaps.Free(killed.offset, killed.size);
+            kills.pop();
+        }
+        if (desc.size == 0) {
+            desc.offset = 0;
+            continue;
+        }
+        desc.offset = gaps.Allocate(desc.size);
+        kills.push({desc.kill, idx});
+    }
+}
+
+static MemoryPlan planWith(PlanMethod method, std::vector<MemoryDesc> blocks,
+                           std::pair<int32_t, int32_t> range) {
+    switch (method) {
+        case PlanMethod::BEST_FIT:
+            return bestFit(std::move(blocks), range);
+        case PlanMethod::GREEDY_BY_SIZE:
+            greedyBySize(blocks);
+            break;
+        case PlanMethod::GREEDY_BY_BREADTH:
+            greedyByBreadth(blocks, range);
+            break;
+        case PlanMethod::FIRST_FIT:
+            firstFit(blocks);
+            break;
+        default:
+            LOG(FATAL) << "Unknown planning method.";
+    }
+    auto peak = std::transform_reduce(
+        blocks.begin(), blocks.end(), uint64_t(0),
+        [](uint64_t a, uint64_t b) { return std::max(a, b); },
+        [](const MemoryDesc &desc) { return desc.offset + desc.size; });
+    return MemoryPlan(peak, std::move(blocks));
+}
+
+MemoryPlan PlanMemory(const LifetimeStat &stat, const PlanOptions &opts) {
+    // Round sizes of blocks up to alignment
+    auto align = std::max(opts.alignment, uint64_t(1));
+    auto blocks = Transform<std::vector<MemoryDesc>>(
+        stat.values, [&](auto &lt) {
+            MemoryDesc desc(lt);
+            desc.size = (desc.size + align - 1) / align * align;
+            return desc;
+        });
+    if (opts.method != PlanMethod::PORTFOLIO)
+        return planWith(opts.method, std::move(blocks), stat.range);
+
+    // Run all strategies and choose the one with lowest peak
+    constexpr PlanMethod methods[]{
+        PlanMethod::BEST_FIT, PlanMethod::GREEDY_BY_SIZE,
+        PlanMethod::GREEDY_BY_BREADTH, PlanMethod::FIRST_FIT};
+    constexpr auto nMethods = sizeof(methods) / sizeof(methods[0]);
+    std::vector<std::optional<MemoryPlan>> plans(nMethods);
+    ParallelFor(nMethods, [&](size_t i) {
+        plans[i] = planWith(methods[i], blocks, stat.range);
+    });
+    auto best = std::min_element(
+        plans.begin(), plans.end(),
+        [](auto &lhs, auto &rhs) { return lhs->peak < rhs->peak; });
+    return std::move(best->value());
+}
+
+}  // namespace hmcos
@@ -0,0 +1,416 @@
+#include <hmcos/sched/flat.hpp>
+#include <hmcos/sched/sched.hpp>
+#include <cmath>
+#include <numeric>
+#include <tuple>
+
+namespace hmcos {
+
+/// Peak of a range of memory states, and number of states reaching it
+struct RangePeak {
+    int64_t mem = INT64_MIN;
+    uint32_t count = 0;
+
+    RangePeak Add(int64_t delta) const {
+        return count == 0 ? *this : RangePeak{mem + delta, count};
+    }
+
+    static RangePeak Combine(const RangePeak &lhs, const RangePeak &rhs) {
+        if (lhs.mem != rhs.mem) return lhs.mem > rhs.mem ? lhs : rhs;
+        return {lhs.mem, lhs.count + rhs.count};
+    }
+};
+
+/// Segment tree of memory states over time, which answers peak of any range
+class PeakTree {
+public:
+    explicit PeakTree(const std::vector<int64_t> &states)
+        : size(states.size()), nodes(2 * states.size()) {
+        for (auto [t, mem] : EnumRange(states)) nodes[size + t] = {mem, 1};
+        for (auto i = size; i-- > 1;)
+            nodes[i] = RangePeak::Combine(nodes[2 * i], nodes[2 * i + 1]);
+    }
+
+    void Set(size_t t, int64_t mem) {
+        auto i = size + t;
+        nodes[i] = {mem, 1};
+        for (i /= 2; i > 0; i /= 2)
+            nodes[i] = RangePeak::Combine(nodes[2 * i], nodes[2 * i + 1]);
+    }
+
+    /// Peak of states in `[begin, end)`
+    RangePeak Query(size_t begin, size_t end) const {
+        RangePeak peak;
+        for (auto l = begin + size, r = end + size; l < r; l /= 2, r /= 2) {
+            if (l & 1) peak = RangePeak::Combine(peak, nodes[l++]);
+            if (r & 1) peak = RangePeak::Combine(peak, nodes[--r]);
+        }
+        return peak;
+    }
+
+private:
+    size_t size;
+    std::vector<RangePeak> nodes;
+};
+
+/// Local search over schedules, where a move takes an op from its position
+/// and inserts it at another valid position
+/// Memory before and during each op are kept, so that a move is evaluated
+/// from changes caused by values the moved op consumes or produces, without
+/// recomputing states of other ops. Memory states follow `EstimatePeak`.
+class ScheduleRefiner {
+public:
+    ScheduleRefiner(const FlatGraph &flat, const std::vector<OpRef> &sched)
+        : flat(flat),
+          opInputs(flat.NumOps()),
+          ovlValue(flat.NumOps(), NO_VALUE),
+          preds(flat.NumOps()),
+          succs(flat.NumOps()),
+          valUsers(flat.NumValues()),
+          seq(flat.Compile(sched)),
+          pos(flat.NumOps()),
+          before(flat.NumOps() + 1),
+          during(flat.NumOps()) {
+        // Record distinct inputs and neighbors of each op
+        for (auto i = 0u; i < flat.NumOps(); i++) {
+            for (auto k = flat.inBegin[i]; k < flat.inBegin[i + 1]; k++) {
+                auto v = flat.inputs[k];
+                if (Contains(opInputs[i], v)) continue;
+                opInputs[i].push_back(v);
+                valUsers[v].push_back(i);
+                auto def = flat.defOp[v];
+                if (def == FlatGraph::NO_OP) continue;
+                AddUnique(preds[i], def);
+                AddUnique(succs[def], i);
+            }
+
+            // The input is overlapped only if it is killed at its last
+            // occurrence in inputs of this op
+            auto ovlVal = flat.OverlapValue(i);
+            if (ovlVal == OVERLAP_FAILED) continue;
+            auto ovlEnd = flat.inputs.begin() + flat.inBegin[i + 1];
+            if (std::find(flat.inputs.begin() + flat.inBegin[i] +
+                              flat.overlap[i] + 1,
+                          ovlEnd, ovlVal) == ovlEnd)
+                ovlValue[i] = ovlVal;
+        }
+
+        // Compute memory states of input schedule
+        for (auto [t, x] : EnumRange(seq)) pos[x] = uint32_t(t);
+        auto useCnt =
+            Transform<std::vector<uint32_t>>(valUsers, [](auto &users) {
+                return uint32_t(users.size());
+            });
+        before[0] = flat.inputSize;
+        for (auto [t, x] : EnumRange(seq)) {
+            auto inc = int64_t(flat.outSize[x]), dec = int64_t(0);
+            for (auto v : opInputs[x]) {
+                if (--useCnt[v] != 0) continue;
+                dec += flat.valSize[v];
+                if (v == ovlValue[x]) inc = 0;
+            }
+            during[t] = before[t] + inc;
+            before[t + 1] = before[t] + int64_t(flat.outSize[x]) - dec;
+        }
+        tree = std::make_unique<PeakTree>(during);
+    }
+
+    uint32_t NumOps() const { return flat.NumOps(); }
+
+    /// Peak of current schedule
+    RangePeak Peak() const {
+        return RangePeak::Combine({int64_t(flat.inputSize), 1},
+                                  tree->Query(0, NumOps()));
+    }
+
+    /// Range of positions where op `x` can be placed
+    std::pair<uint32_t, uint32_t> ValidRange(uint32_t x) const {
+        uint32_t first = 0, last = NumOps() - 1;
+        for (auto p : preds[x]) first = std::max(first, pos[p] + 1);
+        for (auto s : succs[x]) last = std::min(last, pos[s] - 1);
+        return {first, last};
+    }
+
+    uint32_t Position(uint32_t x) const { return pos[x]; }
+
+    /// Peak of schedule after op `x` is moved to position `j`
+    RangePeak Evaluate(uint32_t x, uint32_t j) const {
+        auto move = describe(x, j);
+        auto i = pos[x];
+        auto peak = RangePeak::Combine({int64_t(flat.inputSize), 1},
+                                       tree->Query(0, std::min(i, j)));
+        peak = RangePeak::Combine(peak,
+                                  tree->Query(std::max(i, j) + 1, NumOps()));
+        peak = RangePeak::Combine(peak, {move.xDuring, 1});
+
+        // States of ops in window change by deltas which are constant between
+        // adjacent cuts, except at ops with corrections
+        for (auto k = 0u; k + 1 < move.cuts.size(); k++) {
+            auto begin = move.cuts[k], end = move.cuts[k + 1];
+            auto delta = move.Delta(begin);
+            if (end == begin + 1) delta += move.Correction(begin);
+            peak = RangePeak::Combine(peak,
+                                      tree->Query(begin, end).Add(delta));
+        }
+
+        return peak;
+    }
+
+    /// Move op `x` to position `j`
+    void Apply(uint32_t x, uint32_t j) {
+        auto move = describe(x, j);
+        auto i = pos[x];
+
+        // Compute states in window before shifting ops
+        auto nWin = move.winEnd - move.winBegin;
+        std::vector<int64_t> winBefore(nWin), winDuring(nWin);
+        for (auto t = move.winBegin; t < move.winEnd; t++) {
+            auto delta = move.Delta(t);
+            winBefore[t - move.winBegin] = before[t] + delta;
+            winDuring[t - move.winBegin] =
+                during[t] + delta + move.Correction(t);
+        }
+
+        // Shift ops in window and place `x` at `j`
+        auto later = i < j;
+        auto xBefore = later ? before[j + 1] + move.Delta(j + 1) : before[j];
+        if (later)
+            std::copy(seq.begin() + i + 1, seq.begin() + j + 1,
+                      seq.begin() + i);
+        else
+            std::copy_backward(seq.begin() + j, seq.begin() + i,
+                               seq.begin() + i + 1);
+        seq[j] = x;
+        for (auto t = move.winBegin; t < move.winEnd; t++) {
+            auto newPos = later ? t - 1 : t + 1;
+            pos[seq[newPos]] = newPos;
+            before[newPos] = winBefore[t - move.winBegin];
+            during[newPos] = winDuring[t - move.winBegin];
+            tree->Set(newPos, during[newPos]);
+        }
+        pos[x] = j;
+        before[j] = xBefore;
+        during[j] = move.xDuring;
+        tree->Set(j, during[j]);
+    }
+
+    /// Ops in current schedule
+    std::vector<OpRef> Schedule() const { return flat.Decompile(seq); }
+
+private:
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+
+    /// Changes of memory states caused by a move
+    /// Ops in window `[winBegin, winEnd)` are shifted by one position. Before
+    /// each of them, memory changes by a delta which is piecewise constant, and
+    /// some of them change their overlapping.
+    struct MoveDesc {
+        uint32_t winBegin, winEnd;
+        /// Sign of size of `x` outputs in deltas
+        int64_t outSign;
+        int64_t outSize;
+        /// Inputs of `x`, with their sizes and times from which delta contains
+        /// them
+        std::vector<std::tuple<uint32_t, int64_t, int64_t>> inputs;
+        /// Corrections of states during ops at given positions
+        std::vector<std::pair<uint32_t, int64_t>> corrections;
+        /// Positions where delta or correction may change, in increasing order
+        std::vector<uint32_t> cuts;
+        /// Memory during `x` at new position
+        int64_t xDuring;
+
+        int64_t Delta(uint32_t t) const {
+            auto delta = outSign * outSize;
+            for (auto &[v, size, from] : inputs)
+                if (t >= from) delta -= outSign * size;
+            return delta;
+        }
+
+        int64_t Correction(uint32_t t) const {
+            int64_t corr = 0;
+            for (auto &[p, c] : corrections)
+                if (p == t) corr += c;
+            return corr;
+        }
+    };
+
+    MoveDesc describe(uint32_t x, uint32_t j) const {
+        // Moving `x` later removes its effect from memory before ops in window,
+        // and moving it earlier adds its effect
+        auto i = pos[x];
+        auto later = i < j;
+        MoveDesc move;
+        move.winBegin = later ? i + 1 : j;
+        move.winEnd = later ? j + 1 : i;
+        move.outSign = later ? -1 : 1;
+        move.outSize = int64_t(flat.outSize[x]);
+        move.cuts = {move.winBegin, move.winEnd};
+
+        auto inc = move.outSize;
+        for (auto v : opInputs[x]) {
+            // Find last uses of this value, with and without `x`
+            int64_t lastOther = -1;
+            for (auto u : valUsers[v])
+                if (u != x) lastOther = std::max(lastOther, int64_t(pos[u]));
+            auto last = std::max(lastOther, int64_t(i));
+
+            // When `x` is moved later, this value is no longer freed in window
+            // after its last use. When `x` is moved earlier, it is freed after
+            // its last use by other ops.
+            auto freed = (later ? last : lastOther) + 1;
+            move.inputs.push_back({v, int64_t(flat.valSize[v]), freed});
+            if (freed > move.winBegin && freed < move.winEnd)
+                move.cuts.push_back(uint32_t(freed));
+
+            // The last use of this value in window changes whether it overlaps
+            // output of that op
+            auto lastInWin = later ? last : lastOther;
+            if (lastInWin >= move.winBegin && lastInWin < move.winEnd &&
+                lastInWin != i && ovlValue[seq[lastInWin]] == v) {
+                auto t = uint32_t(lastInWin);
+                auto size = int64_t(flat.outSize[seq[t]]);
+                move.corrections.push_back({t, later ? size : -size});
+                move.cuts.push_back(t);
+                move.cuts.push_back(t + 1);
+            }
+
+            // Check if `x` kills and overlaps this value at new position
+            if (lastOther < int64_t(j) + (later ? 1 : 0) && v == ovlValue[x])
+                inc = 0;
+        }
+        std::sort(move.cuts.begin(), move.cuts.end());
+        move.cuts.erase(std::unique(move.cuts.begin(), move.cuts.end()),
+                        move.cuts.end());
+
+        // Memory before `x` is memory before op at `j` if it is moved earlier,
+        // and memory after op at `j` without `x` if it is moved later
+        auto xBefore = later ? before[j + 1] + move.Delta(j + 1) : before[j];
+        move.xDuring = xBefore + inc;
+        return move;
+    }
+
+    const FlatGraph &flat;
+    /// Distinct inputs, overlapped input and neighbors of each op
+    std::vector<std::vector<uint32_t>> opInputs;
+    std::vector<uint32_t> ovlValue;
+    std::vector<std::vector<uint32_t>> preds, succs;
+    /// Distinct users of each value
+    std::vector<std::vector<uint32_t>> valUsers;
+
+    /// Op at each position and position of each op
+    std::vector<uint32_t> seq, pos;
+    /// Memory before and during op at each position
+    std::vector<int64_t> before, during;
+    std::unique_ptr<PeakTree> tree;
+};
+
+std::vector<OpRef> RefineSchedule(const Graph &graph,
+                                  const std::vector<OpRef> &sched,
+                                  const RefineOptions &opts) {
+    FlatGraph flat(graph);
+    ScheduleRefiner refiner(flat, sched);
+    auto nOps = refiner.NumOps();
+    if (nOps < 2) return sched;
+
+    // Propose a move of random op. Half of the moves swap the op with its
+    // neighbor, and others move it anywhere in its valid range.
+    std::mt19937_64 rng(opts.seed);
+    auto propose = [&](uint32_t &x, uint32_t &j) {
+        x = rng() % nOps;
+        auto i = refiner.Position(x);
+        auto [first, last] = refiner.ValidRange(x);
+        if (first == last) return false;
+        if (rng() % 2 == 0) {
+            j = rng() % 2 == 0 ? i - 1 : i + 1;
+            if (j < first || j > last) j = 2 * i - j;
+        } else {
+            j = first + rng() % (last - first);
+            if (j >= i) j++;
+        }
+        return true;
+    };
+
+    // Schedules are compared by peak, and then number of states reaching peak,
+    // which guides search on plateaus
+    auto better = [](const RangePeak &lhs, const RangePeak &rhs) {
+        return std::tie(lhs.mem, lhs.count) < std::tie(rhs.mem, rhs.count);
+    };
+
+    // Energy difference used in acceptance probability of annealing. At most
+    // |V| states reach peak, so each of them weighs less than one byte and
+    // energy follows the same order as `better`.
+    auto countScale = 1.0 / (double(nOps) + 1);
+    auto energyDiff = [&](const RangePeak &lhs, const RangePeak &rhs) {
+        return double(lhs.mem - rhs.mem) +
+               (double(lhs.count) - double(rhs.count)) * countScale;
+    };
+
+    // Run local search until time or move limit
+    auto begin = std::chrono::steady_clock::now();
+    auto initPeak = refiner.Peak(), curPeak = initPeak, bestPeak = initPeak;
+    auto bestSched = sched;
+    std::vector<size_t> tabuUntil(nOps, 0);
+    auto temp = opts.initTemp * double(initPeak.mem);
+    size_t nMoves = 0;
+    for (size_t iter = 0;; iter++) {
+        // Check limits and cool down
+        if (opts.maxMoves != 0 && nMoves >= opts.maxMoves) break;
+        if (iter % 256 == 0) {
+            auto elapsed = std::chrono::steady_clock::now() - begin;
+            if (elapsed >= opts.timeLimit) break;
+            auto progress = double(elapsed.count()) / opts.timeLimit.count();
+            if (opts.maxMoves != 0)
+                progress = std::max(progress, double(nMoves) / opts.maxMoves);
+            temp = opts.initTemp * double(initPeak.mem) * (1 - progress);
+        }
+
+        // Choose a move
+        uint32_t x = 0, j = 0;
+        RangePeak newPeak;
+        if (opts.method == RefineMethod::ANNEALING) {
+            nMoves++;
+            if (!propose(x, j)) continue;
+            newPeak = refiner.Evaluate(x, j);
+            auto diff = energyDiff(newPeak, curPeak);
+            if (diff > 0 &&
+                (temp <= 0 || std::uniform_real_distribution<double>()(rng) >=
+                                  std::exp(-diff / temp)))
+                continue;
+        } else {
+            // Take best sampled move of ops not recently moved, unless the
+            // move improves the best peak
+            auto found = false;
+            for (auto k = 0u; k < opts.tabuSamples; k++) {
+                uint32_t cx, cj;
+                nMoves++;
+                if (!propose(cx, cj)) continue;
+                auto peak = refiner.Evaluate(cx, cj);
+                if (tabuUntil[cx] > iter && peak.mem >= bestPeak.mem) continue;
+                if (found && !better(peak, newPeak)) continue;
+                x = cx, j = cj, newPeak = peak;
+                found = true;
+            }
+            if (!found) continue;
+            tabuUntil[x] = iter + opts.tabuTenure;
+        }
+
+        // Apply the move and record best schedule
+        refiner.Apply(x, j);
+        curPeak = newPeak;
+        if (better(curPeak, bestPeak)) {
+            bestPeak = curPeak;
+            if (bestPeak.mem < initPeak.mem) bestSched = refiner.Schedule();
+        }
+    }
+
+    // Keep input schedule if it is not improved
+    LOG(INFO) << fmt::format(
+        "Refined peak from {} KB to {} KB with {} moves evaluated.",
+        initPeak.mem / 1024, bestPeak.mem / 1024, nMoves);
+    if (flat.EstimatePeak(flat.Compile(bestSched)) >
+        flat.EstimatePeak(flat.Compile(sched)))
+        return sched;
+    return bestSched;
+}
+
+}  // namespace hmcos
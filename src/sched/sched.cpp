@@ -1,9 +1,17 @@
+#include <hmcos/sched/flat.hpp>
 #include <hmcos/sched/life.hpp>
 #include <hmcos/sched/mem.hpp>
 #include <hmcos/sched/pass.hpp>
 #include <hmcos/sched/sched.hpp>
+#include <hmcos/util/bitset.hpp>
+#include <hmcos/util/parallel.hpp>
 #include <hmcos/util/progress.hpp>
+#include <hmcos/util/spill.hpp>
 #include <hmcos/util/viz.hpp>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 namespace hmcos {
 
@@ -30,43 +38,51 @@ void PlotSchedule(const std::vector<OpRef> &sched, const Graph &graph,
     creator.Render(dir, format);
 }
 
-/// Extract zero-indegree vertices from predecessor count map and move it to the
-/// ordered vector
-template <class VertRef>
-static void extractZeroIn(std::unordered_map<VertRef, uint32_t> &predCnt,
-                          std::vector<VertRef> &zeroPred) {
-    for (auto &[vert, cnt] : predCnt)
-        if (cnt == 0) Insert(zeroPred, vert);
-    for (auto &op : zeroPred) predCnt.erase(op);
-}
-
-template <class Vert>
-static std::shared_ptr<Vert> sampleVertex(
-    std::unordered_map<std::shared_ptr<Vert>, uint32_t> &predCnt,
-    std::vector<std::shared_ptr<Vert>> &zeroPred, std::mt19937 &rng) {
-    auto vert = zeroPred[rng() % zeroPred.size()];
-    Remove(zeroPred, vert);
-    for (auto &succ : vert->succs)
-        if (Is<Vert>(succ)) predCnt[As<Vert>(succ)]--;
-    extractZeroIn(predCnt, zeroPred);
-    return vert;
+/// Sample a topological order of a DAG of densely indexed vertices
+/// `predCnt` is the number of predecessors of each vertex, and `succs` lists
+/// successors of each vertex, once for each edge. Ready vertices are kept in an
+/// unordered array, so that each step costs constant time besides visiting
+/// successors.
+template <class Visit>
+static void sampleTopoOrder(std::vector<uint32_t> predCnt,
+                            const std::vector<std::vector<uint32_t>> &succs,
+                            std::mt19937 &rng, Visit visit) {
+    // Initialize ready vertices
+    std::vector<uint32_t> ready;
+    for (auto [v, cnt] : EnumRange(predCnt))
+        if (cnt == 0) ready.push_back(uint32_t(v));
+
+    // Pick a ready vertex each time and release its successors
+    while (!ready.empty()) {
+        auto idx = rng() % ready.size();
+        auto v = ready[idx];
+        ready[idx] = ready.back();
+        ready.pop_back();
+        visit(v);
+        for (auto succ : succs[v])
+            if (--predCnt[succ] == 0) ready.push_back(succ);
+    }
 }
 
 std::vector<OpRef> RandomSample(const Graph &graph, std::mt19937 &rng) {
-    // Initialize predecessor count map
-    std::unordered_map<OpRef, uint32_t> predCnt;
-    for (auto &op : graph.ops) predCnt.insert({op, uint32_t(op->preds.size())});
-    for (auto &input : graph.inputs)
-        for (auto &succ : input->succs) predCnt[As<Op>(succ)]--;
-
-    // Initialize zero predecessor set
-    std::vector<OpRef> zeroPred;
-    extractZeroIn(predCnt, zeroPred);
+    // Build successor lists and predecessor counts. Ops are the first vertices
+    // in graph, so other IDs are skipped. Inputs are not counted.
+    auto nOps = uint32_t(graph.ops.size());
+    std::vector<uint32_t> predCnt(nOps, 0);
+    std::vector<std::vector<uint32_t>> succs(nOps);
+    for (auto i = 0u; i < nOps; i++) {
+        for (auto s : graph.SuccIds(i)) {
+            if (s >= nOps) continue;
+            succs[i].push_back(s);
+            predCnt[s]++;
+        }
+    }
 
     // Sample one schedule
     std::vector<OpRef> sched;
-    while (!zeroPred.empty())
-        sched.push_back(sampleVertex(predCnt, zeroPred, rng));
+    sched.reserve(graph.ops.size());
+    sampleTopoOrder(std::move(predCnt), succs, rng,
+                    [&](uint32_t v) { sched.push_back(graph.ops[v]); });
 
     return sched;
 }
@@ -85,6 +101,9 @@ struct SchedResult {
     std::vector<OpRef> seq;
     /// Memory states of scheduled sequence
     MemStateVec states;
+    /// Whether this schedule is proved optimal. It is false if some partial
+    /// schedules are dropped because of beam limit.
+    bool optimal = true;
 
     SchedResult() : valid(false) {}
 
@@ -103,30 +122,345 @@ struct SchedResult {
     }
 };
 
-struct PartialSchedResult : public SchedResult {
-    /// Predecessor count of vertices
-    /// This map serializes the graph structure to avoid traversal of the graph
-    /// when computing zero-indegree sets.
-    std::unordered_map<HierVertRef, uint32_t> predCnt;
-    /// Use count of values
-    std::unordered_map<ValueRef, uint32_t> useCnt;
+/// All ops in a hierarchical vertex
+static std::vector<OpRef> vertOps(const HierVertRef &vert) {
+    switch (vert->Kind()) {
+        case HierKind::SEQUENCE:
+            return Cast<Sequence>(vert)->ops;
+        case HierKind::GROUP: {
+            std::vector<OpRef> ops;
+            for (auto &seq : Cast<Group>(vert)->seqs) Extend(ops, seq->ops);
+            return ops;
+        }
+        default:
+            return {};
+    }
+}
 
-    PartialSchedResult() : SchedResult() {}
+/// Summary of scheduled vertices of a DP state, which is needed to expand it
+/// The summary of a state is derived from that of its parent when one more
+/// vertex is scheduled, so expanding a state does not rescan all vertices and
+/// their edges.
+struct DpFrontier {
+    /// Zero-indegree vertices, in increasing order
+    std::vector<uint32_t> zeroIn;
+    /// Remaining use counts of values partly consumed by scheduled vertices,
+    /// in increasing order of value indices. Values not in this list are not
+    /// consumed yet, and values that are no longer used are omitted.
+    std::vector<std::pair<uint32_t, uint32_t>> useCnt;
+    /// Position of first unscheduled vertex in decreasing order of footprints
+    uint32_t boundPos = 0;
+};
 
-    PartialSchedResult(std::vector<OpRef> &&seq, MemStateVec &&states,
-                       std::unordered_map<HierVertRef, uint32_t> &&predCnt,
-                       std::unordered_map<ValueRef, uint32_t> &&useCnt)
-        : SchedResult(std::move(seq), std::move(states)),
-          predCnt(std::move(predCnt)),
-          useCnt(std::move(useCnt)) {}
+/// Dense indexing of vertices scheduled by DP
+/// Vertices are numbered in the order they are given. Only edges between
+/// indexed vertices are kept, so predecessors outside the vertex set (e.g.
+/// inputs of the hierarchical graph) are not counted.
+class DpVertIndex {
+public:
+    /// `useCnt` is the use count of values before any vertex is scheduled.
+    DpVertIndex(std::vector<HierVertRef> &&verts,
+                const std::unordered_map<ValueRef, uint32_t> &useCnt)
+        : verts(std::move(verts)),
+          preds(this->verts.size()),
+          succs(this->verts.size()),
+          zobrist(this->verts.size()),
+          footprint(this->verts.size()),
+          boundOrder(this->verts.size()),
+          uses(this->verts.size()),
+          inputs(this->verts.size()) {
+        // Number vertices
+        std::unordered_map<HierVertRef, uint32_t> vertIdx;
+        for (auto [i, vert] : EnumRange(this->verts))
+            vertIdx.insert({vert, uint32_t(i)});
+
+        // Build predecessor and successor lists
+        for (auto [i, vert] : EnumRange(this->verts)) {
+            for (auto &succ : vert->succs) {
+                if (!Contains(vertIdx, succ)) continue;
+                auto s = vertIdx[succ];
+                preds[s].push_back(uint32_t(i));
+                AddUnique(succs[i], s);
+            }
+        }
 
-    void Update(PartialSchedResult &&other) {
-        if (other.states.Peak() < this->states.Peak()) {
-            this->seq.swap(other.seq);
-            this->states.Swap(other.states);
-            this->predCnt.swap(other.predCnt);
-            this->useCnt.swap(other.useCnt);
+        // Assign random keys to vertices for Zobrist hashing. Use fixed seed so
+        // that hash values are reproducible across runs.
+        std::mt19937_64 rng(ZOBRIST_SEED);
+        for (auto &key : zobrist) key = rng();
+
+        // Sort vertices by their footprints for computing lower bounds
+        std::vector<std::vector<OpRef>> ops(this->verts.size());
+        for (auto [i, vert] : EnumRange(this->verts)) {
+            ops[i] = vertOps(vert);
+            for (auto &op : ops[i])
+                footprint[i] = std::max(footprint[i], OpFootprint(op));
+        }
+        std::iota(boundOrder.begin(), boundOrder.end(), 0u);
+        std::stable_sort(boundOrder.begin(), boundOrder.end(),
+                         [&](auto lhs, auto rhs) {
+                             return footprint[lhs] > footprint[rhs];
+                         });
+
+        // Number values consumed by vertices and record their consumers
+        std::unordered_map<ValueRef, uint32_t> valIdx;
+        std::unordered_set<ValueRef> produced;
+        std::vector<std::vector<ValueUse>> consumers;
+        for (auto [i, vertOps] : EnumRange(ops)) {
+            for (auto &op : vertOps) {
+                for (auto &val : op->inputs) {
+                    if (val->kind == ValueKind::PARAM) continue;
+                    auto [it, inserted] =
+                        valIdx.insert({val, uint32_t(values.size())});
+                    if (inserted) {
+                        values.push_back(val);
+                        consumers.emplace_back();
+                    }
+                    auto &valUses = consumers[it->second];
+                    if (valUses.empty() || valUses.back().index != i)
+                        valUses.push_back({uint32_t(i), 0});
+                    valUses.back().count++;
+                }
+            }
+            for (auto &op : vertOps)
+                for (auto &val : op->outputs) produced.insert(val);
+        }
+
+        // Transpose consumers to values consumed by each vertex, which are
+        // then in increasing order of value indices
+        for (auto [i, valUses] : EnumRange(consumers))
+            for (auto &use : valUses)
+                uses[use.index].push_back({uint32_t(i), use.count});
+
+        // Find values consumed by each vertex but produced outside of it
+        for (auto [i, vertOps] : EnumRange(ops)) {
+            std::unordered_set<ValueRef> local;
+            for (auto &op : vertOps)
+                for (auto &val : op->outputs) local.insert(val);
+            for (auto &op : vertOps)
+                for (auto &val : op->inputs)
+                    if (Contains(valIdx, val) && !Contains(local, val))
+                        AddUnique(inputs[i], valIdx[val]);
+        }
+
+        // Use counts before any vertex is scheduled
+        baseCnt.resize(values.size());
+        for (auto [i, val] : EnumRange(values)) {
+            if (Contains(useCnt, val))
+                baseCnt[i] = useCnt.at(val);
+            else if (Contains(produced, val))
+                baseCnt[i] = uint32_t(val->uses.size());
+        }
+    }
+
+    uint32_t Size() const { return uint32_t(verts.size()); }
+    const HierVertRef &Vertex(uint32_t v) const { return verts[v]; }
+    uint64_t Zobrist(uint32_t v) const { return zobrist[v]; }
+
+    /// Summary of a state where vertices in `sched` are scheduled, computed
+    /// from scratch. This takes time linear to the whole index, so it is only
+    /// used where the summary of the parent state is not available.
+    DpFrontier Frontier(const SmallBitset &sched) const {
+        DpFrontier frontier;
+        for (auto v = 0u; v < Size(); v++) {
+            if (sched.Test(v)) continue;
+            if (std::all_of(preds[v].begin(), preds[v].end(),
+                            [&](auto u) { return sched.Test(u); }))
+                frontier.zeroIn.push_back(v);
+        }
+        std::vector<uint32_t> cnt(baseCnt);
+        std::vector<bool> consumed(values.size(), false);
+        for (auto v = 0u; v < Size(); v++) {
+            if (!sched.Test(v)) continue;
+            for (auto &use : uses[v]) {
+                cnt[use.index] -= use.count;
+                consumed[use.index] = true;
+            }
+        }
+        for (auto i = 0u; i < values.size(); i++)
+            if (consumed[i] && cnt[i] > 0)
+                frontier.useCnt.push_back({i, cnt[i]});
+        frontier.boundPos = nextBoundPos(sched, 0);
+        return frontier;
+    }
+
+    /// Summary of the state after scheduling vertex `v`, derived from summary
+    /// `prev` of its parent. `sched` is the set of scheduled vertices including
+    /// `v`. This takes time linear to the summary, successors of `v` with their
+    /// predecessors, and values consumed by `v`.
+    DpFrontier Advance(const DpFrontier &prev, const SmallBitset &sched,
+                       uint32_t v) const {
+        DpFrontier frontier;
+
+        // Replace `v` with its successors whose predecessors are all scheduled
+        std::vector<uint32_t> ready;
+        for (auto s : succs[v])
+            if (std::all_of(preds[s].begin(), preds[s].end(),
+                            [&](auto u) { return sched.Test(u); }))
+                ready.push_back(s);
+        std::sort(ready.begin(), ready.end());
+        frontier.zeroIn.reserve(prev.zeroIn.size() + ready.size() - 1);
+        for (auto u : prev.zeroIn)
+            if (u != v) frontier.zeroIn.push_back(u);
+        auto mid = frontier.zeroIn.size();
+        frontier.zeroIn.insert(frontier.zeroIn.end(), ready.begin(),
+                               ready.end());
+        std::inplace_merge(frontier.zeroIn.begin(),
+                           frontier.zeroIn.begin() + mid,
+                           frontier.zeroIn.end());
+
+        // Merge values consumed by `v` into remaining use counts
+        frontier.useCnt.reserve(prev.useCnt.size() + uses[v].size());
+        auto it = prev.useCnt.begin(), end = prev.useCnt.end();
+        for (auto &use : uses[v]) {
+            for (; it != end && it->first < use.index; ++it)
+                frontier.useCnt.push_back(*it);
+            auto cnt = baseCnt[use.index];
+            if (it != end && it->first == use.index) cnt = (it++)->second;
+            cnt -= use.count;
+            if (cnt > 0) frontier.useCnt.push_back({use.index, cnt});
+        }
+        frontier.useCnt.insert(frontier.useCnt.end(), it, end);
+
+        // Skip scheduled vertices of largest footprints
+        frontier.boundPos = nextBoundPos(sched, prev.boundPos);
+        return frontier;
+    }
+
+    /// Use count of values consumed by vertex `v` but produced outside of it,
+    /// in state of summary `frontier`. Values that are no longer used are
+    /// omitted.
+    std::unordered_map<ValueRef, uint32_t> UseCount(const DpFrontier &frontier,
+                                                    uint32_t v) const {
+        std::unordered_map<ValueRef, uint32_t> useCnt;
+        for (auto i : inputs[v]) {
+            auto cnt = baseCnt[i];
+            auto it = std::lower_bound(
+                frontier.useCnt.begin(), frontier.useCnt.end(),
+                std::make_pair(i, 0u));
+            if (it != frontier.useCnt.end() && it->first == i) cnt = it->second;
+            if (cnt > 0) useCnt.insert({values[i], cnt});
         }
+        return useCnt;
+    }
+
+    /// Lower bound of peak of any schedule after state of summary `frontier`,
+    /// which is the largest footprint of unscheduled vertices
+    int64_t LowerBound(const DpFrontier &frontier) const {
+        if (frontier.boundPos == Size()) return 0;
+        return footprint[boundOrder[frontier.boundPos]];
+    }
+
+private:
+    static constexpr uint64_t ZOBRIST_SEED = 0x9e3779b97f4a7c15ull;
+
+    /// First position from `pos` in `boundOrder` of unscheduled vertex
+    uint32_t nextBoundPos(const SmallBitset &sched, uint32_t pos) const {
+        while (pos < Size() && sched.Test(boundOrder[pos])) pos++;
+        return pos;
+    }
+
+    std::vector<HierVertRef> verts;
+    std::vector<std::vector<uint32_t>> preds;
+    std::vector<std::vector<uint32_t>> succs;
+    std::vector<uint64_t> zobrist;
+    std::vector<int64_t> footprint;
+    /// Vertices in decreasing order of footprints
+    std::vector<uint32_t> boundOrder;
+
+    /// Number of uses of a value by a vertex, indexed by the other one
+    struct ValueUse {
+        uint32_t index;
+        uint32_t count;
+    };
+    /// Values consumed by indexed vertices
+    std::vector<ValueRef> values;
+    /// Use count of each value before any vertex is scheduled
+    std::vector<uint32_t> baseCnt;
+    /// Values consumed by each vertex, in increasing order of value indices
+    std::vector<std::vector<ValueUse>> uses;
+    /// Values consumed by each vertex but produced outside of it
+    std::vector<std::vector<uint32_t>> inputs;
+};
+
+/// Key of a DP state
+/// A downward-closed set of scheduled vertices uniquely determines the
+/// zero-indegree frontier of the remaining ones, so the scheduled set is used
+/// as key. The Zobrist hash of the set is updated in O(1) when one more vertex
+/// is scheduled.
+struct FrontierKey {
+    /// Set of scheduled vertices
+    SmallBitset sched;
+    /// XOR of Zobrist keys of scheduled vertices
+    uint64_t hash = 0;
+
+    explicit FrontierKey(size_t nVert) : sched(nVert) {}
+
+    /// Key after scheduling vertex `v`
+    FrontierKey With(const DpVertIndex &index, uint32_t v) const {
+        auto key = *this;
+        key.sched.Set(v);
+        key.hash ^= index.Zobrist(v);
+        return key;
+    }
+
+    bool operator==(const FrontierKey &other) const {
+        return this->hash == other.hash && this->sched == other.sched;
+    }
+
+    /// Total order of keys, which is independent of layout of hash tables
+    bool operator<(const FrontierKey &other) const {
+        if (this->hash != other.hash) return this->hash < other.hash;
+        return std::lexicographical_compare(
+            sched.Words(), sched.Words() + sched.NumWords(),
+            other.sched.Words(), other.sched.Words() + other.sched.NumWords());
+    }
+};
+
+/// Node of a persistent list of vertex schedules
+/// Partial results extended from the same one share nodes of their common
+/// prefix, so that extending a partial result does not copy its op sequence and
+/// memory states.
+struct SchedNode {
+    /// Node of previously scheduled vertex, null for the initial node
+    std::shared_ptr<const SchedNode> prev;
+    /// Schedule of this vertex. Memory states are relative to the latest state
+    /// of previous nodes.
+    SchedResult result;
+};
+
+struct PartialSchedResult {
+    /// Last node of scheduled vertices
+    std::shared_ptr<const SchedNode> tail;
+    /// Peak memory of this partial schedule
+    int64_t peak = 0;
+    /// Latest memory of this partial schedule
+    int64_t latest = 0;
+    /// Summary of scheduled vertices
+    DpFrontier frontier;
+
+    /// Create initial result where no vertex in `index` has been scheduled
+    static PartialSchedResult Init(const DpVertIndex &index,
+                                   MemStateVec &&states) {
+        auto peak = states.Peak(), latest = states.Latest();
+        return {std::make_shared<const SchedNode>(
+                    SchedNode{nullptr, {{}, std::move(states)}}),
+                peak, latest, index.Frontier(SmallBitset(index.Size()))};
+    }
+
+    void Update(PartialSchedResult &&other) {
+        if (other.peak < this->peak) *this = std::move(other);
+    }
+
+    /// Rebuild op sequence and memory states of this partial schedule
+    SchedResult Build() const {
+        std::vector<const SchedNode *> nodes;
+        for (auto node = tail.get(); node; node = node->prev.get())
+            nodes.push_back(node);
+        auto result = nodes.back()->result;
+        for (auto it = nodes.rbegin() + 1; it != nodes.rend(); ++it)
+            result.Extend((*it)->result);
+        return result;
     }
 };
 
@@ -152,6 +486,11 @@ struct GroupContext {
 
 namespace std {
 
+template <>
+struct hash<hmcos::FrontierKey> {
+    size_t operator()(const hmcos::FrontierKey &key) const { return key.hash; }
+};
+
 template <>
 struct hash<hmcos::GroupContext> {
     size_t operator()(const hmcos::GroupContext &ctx) const {
@@ -163,14 +502,20 @@ struct hash<hmcos::GroupContext> {
 
 namespace hmcos {
 
-/// A sequence has only one possible schedule. This function also computes
-/// memory states of each op and update predecessor count and use count map.
-static SchedResult scheduleSequence(
-    const SequenceRef &seq, std::unordered_map<ValueRef, uint32_t> &useCnt,
-    int64_t budget) {
+using DpMemo = std::unordered_map<FrontierKey, PartialSchedResult>;
+
+// Make sure subtracting any integer (positive or negative) not so big from it
+// will never overflow.
+static constexpr auto MAX_BUDGET = INT64_MAX / 2;
+
+/// Schedule ops in the given order. This function also computes memory states
+/// of each op and update use count map.
+static SchedResult scheduleOps(const std::vector<OpRef> &ops,
+                               std::unordered_map<ValueRef, uint32_t> &useCnt,
+                               int64_t budget) {
     // Iterate each op and compute memory states
     MemStateVec states;
-    for (auto &op : seq->ops) {
+    for (auto &op : ops) {
         // Find all values killed by this operator
         std::vector<ValueRef> killed;
         for (auto &val : op->inputs) {
@@ -193,7 +538,15 @@ static SchedResult scheduleSequence(
             useCnt.insert({val, uint32_t(val->uses.size())});
     }
 
-    return {std::vector(seq->ops), std::move(states)};
+    return {std::vector(ops), std::move(states)};
+}
+
+/// A sequence has only one possible schedule. This function also computes
+/// memory states of each op and update use count map.
+static SchedResult scheduleSequence(
+    const SequenceRef &seq, std::unordered_map<ValueRef, uint32_t> &useCnt,
+    int64_t budget) {
+    return scheduleOps(seq->ops, useCnt, budget);
 }
 
 /// Schedule group with reverse post-order
@@ -210,168 +563,654 @@ static SchedResult scheduleGroupRpo(
     MemStateVec states;
     for (auto vert : vertRange) {
         auto seq = As<Sequence>(vert);
-        auto [valid, vertSeq, vertStates] =
+        auto vertResult =
             scheduleSequence(seq, useCnt, budget - states.Latest());
-        if (!valid) return {};
-        opSeq.insert(opSeq.end(), vertSeq.begin(), vertSeq.end());
-        states.Extend(vertStates);
+        if (!vertResult.valid) return {};
+        Extend(opSeq, vertResult.seq);
+        states.Extend(vertResult.states);
     }
 
     return {std::move(opSeq), std::move(states)};
 }
 
-static void updateResult(
-    const HierVertRef &vert, const std::vector<HierVertRef> &zeroIn,
-    const PartialSchedResult &result, SchedResult &&vertResult,
-    std::unordered_map<ValueRef, uint32_t> &&useCnt,
-    std::unordered_map<std::vector<HierVertRef>, PartialSchedResult> &newMemo) {
+/// Memoize partial result. If there is already a result for this key, keep the
+/// one with lower peak.
+static void memoize(DpMemo &memo, FrontierKey &&key,
+                    PartialSchedResult &&result) {
+    auto it = memo.find(key);
+    if (it != memo.end())
+        it->second.Update(std::move(result));
+    else
+        memo.insert({std::move(key), std::move(result)});
+}
+
+static void updateResult(const DpVertIndex &index, uint32_t v,
+                         const FrontierKey &key,
+                         const PartialSchedResult &result,
+                         SchedResult &&vertResult, std::vector<DpMemo> &shards) {
     // Do nothing if the result is invalid
     if (!vertResult.valid) return;
 
-    // Extend op sequence
-    auto seq = result.seq;
-    Extend(seq, vertResult.seq);
-
-    // Extend memory states
-    auto states = result.states;
-    states.Extend(vertResult.states);
-
-    // Update zero-indegree set
-    auto predCnt = result.predCnt;
-    for (auto &succ : vert->succs) predCnt[succ]--;
-    auto newZeroIn = zeroIn;
-    Remove(newZeroIn, vert);
-    extractZeroIn(predCnt, newZeroIn);
-
-    // Memoize this partial result
-    PartialSchedResult newResult(std::move(seq), std::move(states),
-                                 std::move(predCnt), std::move(useCnt));
-    if (Contains(newMemo, newZeroIn))
-        newMemo[newZeroIn].Update(std::move(newResult));
-    else
-        newMemo.insert({newZeroIn, std::move(newResult)});
+    // Append schedule of this vertex
+    auto peak =
+        std::max(result.peak, result.latest + vertResult.states.Peak());
+    auto latest = result.latest + vertResult.states.Latest();
+    auto tail = std::make_shared<const SchedNode>(
+        SchedNode{result.tail, std::move(vertResult)});
+
+    // Memoize this partial result in its shard
+    auto newKey = key.With(index, v);
+    auto frontier = index.Advance(result.frontier, newKey.sched, v);
+    auto &shard = shards[newKey.hash % shards.size()];
+    memoize(shard, std::move(newKey),
+            {std::move(tail), peak, latest, std::move(frontier)});
+}
+
+/// Minimal number of partial results expanded by one worker thread
+static constexpr size_t MIN_RESULTS_PER_WORKER = 32;
+
+/// Build partial results of the next DP layer by adding one more vertex to
+/// each partial result in `memo`.
+/// Partial results are expanded in order of their keys. They are split into
+/// contiguous slices, and each slice is expanded by one worker into its own
+/// hash-sharded tables. Tables of the same shard are then merged in slice
+/// order. Among results of equal peak, the one expanded first is always kept,
+/// so the next layer does not depend on number of threads.
+/// Partial results whose lower bound exceeds `boundBudget` are pruned.
+/// `schedVert(vert, useCnt, prev, nThreads)` schedules one vertex after a
+/// partial result. `useCnt` only contains values consumed by the vertex and
+/// can be modified. `nThreads` is the number of threads it may use on its own.
+template <class SchedVertFunc>
+static DpMemo expandLayer(const DpVertIndex &index, const DpMemo &memo,
+                          int64_t boundBudget, size_t nThreads,
+                          SchedVertFunc schedVert) {
+    // Prune partial results and sort the rest by their keys
+    std::vector<const DpMemo::value_type *> entries;
+    entries.reserve(memo.size());
+    for (auto &entry : memo)
+        if (index.LowerBound(entry.second.frontier) <= boundBudget)
+            entries.push_back(&entry);
+    std::sort(entries.begin(), entries.end(),
+              [](auto lhs, auto rhs) { return lhs->first < rhs->first; });
+
+    // Decide number of workers
+    auto maxWorkers = (entries.size() + MIN_RESULTS_PER_WORKER - 1) /
+                      MIN_RESULTS_PER_WORKER;
+    auto nWorkers = std::max(std::min(nThreads, maxWorkers), size_t(1));
+    auto nestedThreads = std::max(nThreads / nWorkers, size_t(1));
+
+    // Expand each slice of partial results
+    std::vector<std::vector<DpMemo>> shards(nWorkers,
+                                            std::vector<DpMemo>(nWorkers));
+    ParallelFor(nWorkers, [&](size_t w) {
+        auto begin = entries.size() * w / nWorkers,
+             end = entries.size() * (w + 1) / nWorkers;
+        for (auto i = begin; i < end; i++) {
+            auto &[key, result] = *entries[i];
+            for (auto v : result.frontier.zeroIn) {
+                auto useCnt = index.UseCount(result.frontier, v);
+                auto vertResult = schedVert(index.Vertex(v), useCnt, result,
+                                            nestedThreads);
+                updateResult(index, v, key, result, std::move(vertResult),
+                             shards[w]);
+            }
+        }
+    });
+
+    // Merge tables of each shard in slice order
+    ParallelFor(nWorkers, [&](size_t s) {
+        auto &dst = shards[0][s];
+        for (auto w = size_t(1); w < nWorkers; w++)
+            for (auto &[key, result] : shards[w][s])
+                memoize(dst, FrontierKey(key), std::move(result));
+    });
+
+    // Collect results from all shards
+    DpMemo newMemo;
+    for (auto &shard : shards[0]) newMemo.merge(shard);
+
+    return newMemo;
+}
+
+/// Estimate number of bytes added by a partial result to its layer. Only the
+/// tail node is counted, as nodes of previous vertices are shared with other
+/// partial results and retained by previous layers.
+static size_t estimateBytes(const DpMemo::value_type &entry) {
+    auto &[key, result] = entry;
+    auto &vertResult = result.tail->result;
+    auto &frontier = result.frontier;
+    return sizeof(entry) + key.sched.NumWords() * sizeof(uint64_t) +
+           frontier.zeroIn.size() * sizeof(uint32_t) +
+           frontier.useCnt.size() * sizeof(frontier.useCnt[0]) +
+           sizeof(SchedNode) + vertResult.seq.size() * sizeof(OpRef) +
+           vertResult.states.Size() * 2 * sizeof(int64_t);
+}
+
+/// Keep partial results in the layer within beam width and byte limit. Results
+/// with lower peak, and then lower latest memory, are preferred. Return whether
+/// any result is dropped.
+static bool truncateLayer(DpMemo &memo, const SchedOptions &opts) {
+    // Check if limits are exceeded
+    auto exceeded = opts.beamWidth != 0 && memo.size() > opts.beamWidth;
+    if (!exceeded && opts.maxLayerBytes != 0) {
+        size_t nBytes = 0;
+        for (auto &entry : memo) nBytes += estimateBytes(entry);
+        exceeded = nBytes > opts.maxLayerBytes;
+    }
+    if (!exceeded) return false;
+
+    // Rank partial results. Keys break ties so that ranking is deterministic.
+    std::vector<DpMemo::iterator> ranked;
+    ranked.reserve(memo.size());
+    for (auto it = memo.begin(); it != memo.end(); ++it) ranked.push_back(it);
+    std::sort(ranked.begin(), ranked.end(), [](auto lhs, auto rhs) {
+        auto &lhsResult = lhs->second, &rhsResult = rhs->second;
+        if (lhsResult.peak != rhsResult.peak)
+            return lhsResult.peak < rhsResult.peak;
+        if (lhsResult.latest != rhsResult.latest)
+            return lhsResult.latest < rhsResult.latest;
+        return lhs->first < rhs->first;
+    });
+
+    // Keep best ones within limits, and at least one of them
+    auto maxSize = opts.beamWidth == 0 ? ranked.size() : opts.beamWidth;
+    size_t nKept = 0, nBytes = 0;
+    while (nKept < std::min(maxSize, ranked.size())) {
+        nBytes += estimateBytes(*ranked[nKept]);
+        if (nKept > 0 && opts.maxLayerBytes != 0 &&
+            nBytes > opts.maxLayerBytes)
+            break;
+        nKept++;
+    }
+    for (auto i = nKept; i < ranked.size(); i++) memo.erase(ranked[i]);
+
+    return true;
+}
+
+/// Number of words in header of a spilled partial result. The header consists
+/// of hash of key, peak, latest memory, and index of the parent partial result
+/// in previous layer (high 32 bits) together with the last scheduled vertex
+/// (low 32 bits). Words of the scheduled set follow the header.
+static constexpr size_t SPILL_HEADER_WORDS = 4;
+/// Expected number of partial results in one partition of a spilled layer
+static constexpr size_t SPILL_PARTITION_SIZE = 1 << 16;
+
+/// Use DP algorithm to schedule sequences in `index`, with DP layers spilled to
+/// files in `opts.spillDir`.
+/// Each layer is a file of partial results sorted by their keys. It is mapped
+/// into memory and scanned sequentially to produce partial results of the next
+/// layer. These are distributed to partitions by high bits of their hashes, so
+/// that each partition can be sorted and deduplicated in memory, and then
+/// appended to the next layer in order. Partial results are expanded in the
+/// same order as `expandLayer`, so the result is also the same.
+/// Records only keep scheduled sets, so summary of each partial result is
+/// computed from its set when it is expanded.
+template <bool displayProgress>
+static SchedResult scheduleGroupDpSpilled(const DpVertIndex &index,
+                                          int64_t budget, int64_t absBudget,
+                                          const SchedOptions &opts) {
+    // Write initial layer
+    auto &dir = opts.spillDir;
+    auto nVert = index.Size();
+    auto nWords = FrontierKey(nVert).sched.NumWords();
+    auto recWords = SPILL_HEADER_WORDS + nWords;
+    auto recBytes = recWords * sizeof(uint64_t);
+    std::vector<std::unique_ptr<SpillFile>> layers;
+    layers.push_back(std::make_unique<SpillFile>(dir));
+    std::vector<uint64_t> rec(recWords, 0);
+    layers.back()->Append(rec.data(), recBytes);
+    size_t nPrev = 1;
+
+    // Iterate |V| steps
+    auto display = displayProgress && opts.displayProgress;
+    for (auto i : ProgressRange(nVert, display)) {
+        if (std::chrono::steady_clock::now() >= opts.deadline) return {};
+
+        // Create partitions for next layer
+        auto partBits = 0u;
+        while ((size_t(1) << partBits) * SPILL_PARTITION_SIZE < nPrev)
+            partBits++;
+        std::vector<std::unique_ptr<SpillFile>> parts(size_t(1) << partBits);
+        for (auto &part : parts) part = std::make_unique<SpillFile>(dir);
+
+        // Expand each partial result in previous layer
+        auto prev = reinterpret_cast<const uint64_t *>(layers.back()->Map());
+        FrontierKey key(nVert);
+        for (size_t r = 0; r < nPrev; r++) {
+            auto src = prev + r * recWords;
+            key.hash = src[0];
+            std::copy_n(src + SPILL_HEADER_WORDS, nWords, key.sched.Words());
+            auto frontier = index.Frontier(key.sched);
+            if (index.LowerBound(frontier) > absBudget) continue;
+            auto peak = int64_t(src[1]), latest = int64_t(src[2]);
+            for (auto v : frontier.zeroIn) {
+                auto useCnt = index.UseCount(frontier, v);
+                auto vertResult = scheduleSequence(
+                    As<Sequence>(index.Vertex(v)), useCnt, budget - latest);
+                if (!vertResult.valid) continue;
+                auto newKey = key.With(index, v);
+                rec[0] = newKey.hash;
+                rec[1] = uint64_t(
+                    std::max(peak, latest + vertResult.states.Peak()));
+                rec[2] = uint64_t(latest + vertResult.states.Latest());
+                rec[3] = uint64_t(r) << 32 | v;
+                std::copy_n(newKey.sched.Words(), nWords,
+                            rec.begin() + SPILL_HEADER_WORDS);
+                auto p = partBits == 0 ? 0 : newKey.hash >> (64 - partBits);
+                parts[p]->Append(rec.data(), recBytes);
+            }
+        }
+        layers.back()->Unmap();
+
+        // Merge partitions into next layer
+        auto next = std::make_unique<SpillFile>(dir);
+        size_t nNext = 0;
+        for (auto &part : parts) {
+            // Sort partial results by key. Stable sort keeps results of the
+            // same key in order of expansion.
+            auto nRec = part->Size() / recBytes;
+            if (nRec == 0) continue;
+            auto data = reinterpret_cast<const uint64_t *>(part->Map());
+            auto keyLess = [&](size_t lhs, size_t rhs) {
+                auto lhsRec = data + lhs * recWords,
+                     rhsRec = data + rhs * recWords;
+                if (lhsRec[0] != rhsRec[0]) return lhsRec[0] < rhsRec[0];
+                return std::lexicographical_compare(
+                    lhsRec + SPILL_HEADER_WORDS, lhsRec + recWords,
+                    rhsRec + SPILL_HEADER_WORDS, rhsRec + recWords);
+            };
+            std::vector<size_t> order(nRec);
+            std::iota(order.begin(), order.end(), size_t(0));
+            std::stable_sort(order.begin(), order.end(), keyLess);
+
+            // Keep the first result with lowest peak for each key
+            for (size_t j = 0; j < nRec;) {
+                auto best = order[j];
+                auto k = j + 1;
+                for (; k < nRec && !keyLess(order[j], order[k]); k++)
+                    if (int64_t(data[order[k] * recWords + 1]) <
+                        int64_t(data[best * recWords + 1]))
+                        best = order[k];
+                next->Append(data + best * recWords, recBytes);
+                nNext++;
+                j = k;
+            }
+            part->Unmap();
+        }
+        if (nNext == 0) return {};
+        LOG_ASSERT(nNext <= UINT32_MAX);
+        layers.push_back(std::move(next));
+        nPrev = nNext;
+    }
+
+    // Trace back vertices of the final partial result
+    LOG_ASSERT(nPrev == 1);
+    std::vector<uint32_t> order(nVert);
+    size_t r = 0;
+    for (auto l = nVert; l > 0; l--) {
+        auto data = reinterpret_cast<const uint64_t *>(layers[l]->Map());
+        auto tag = data[r * recWords + 3];
+        order[l - 1] = uint32_t(tag);
+        r = size_t(tag >> 32);
+        layers[l]->Unmap();
+    }
+
+    // Rebuild schedule of these vertices
+    SchedResult result({}, {});
+    FrontierKey key(nVert);
+    auto frontier = index.Frontier(key.sched);
+    for (auto v : order) {
+        auto useCnt = index.UseCount(frontier, v);
+        result.Extend(scheduleSequence(As<Sequence>(index.Vertex(v)), useCnt,
+                                       MAX_BUDGET));
+        key = key.With(index, v);
+        frontier = index.Advance(frontier, key.sched, v);
+    }
+
+    return result;
 }
 
 /// Use DP algorithm to schedule the group
+/// `budget` limits peak of memory states relative to the start of the group,
+/// while `absBudget` limits absolute memory usage and is used to prune partial
+/// results by lower bounds.
 template <bool displayProgress>
 static SchedResult scheduleGroupDp(
     const GroupRef &group, const std::unordered_map<ValueRef, uint32_t> &useCnt,
-    int64_t budget) {
-    // Initialize predecessor count of sequences inside group
-    std::unordered_map<HierVertRef, uint32_t> predCnt;
-    for (auto &seq : group->seqs)
-        predCnt.insert({seq, uint32_t(seq->preds.size())});
+    int64_t budget, int64_t absBudget, const SchedOptions &opts) {
+    // Index sequences inside group in reverse post-order
+    std::vector<HierVertRef> seqs;
+    for (auto vert : group->Range()) seqs.push_back(std::move(vert));
+    LOG_ASSERT(seqs.size() == group->seqs.size());
+    DpVertIndex index(std::move(seqs), useCnt);
+
+    // Spill layers to files if required
+    if (!opts.spillDir.empty())
+        return scheduleGroupDpSpilled<displayProgress>(index, budget, absBudget,
+                                                       opts);
 
     // Initialize memoization map
-    std::vector<HierVertRef> zeroIn;
-    extractZeroIn(predCnt, zeroIn);
-    std::unordered_map<std::vector<HierVertRef>, PartialSchedResult> memo;
-    memo.insert(
-        {zeroIn,
-         {{}, MemStateVec(), std::move(predCnt), std::unordered_map(useCnt)}});
+    DpMemo memo;
+    memo.insert({FrontierKey(index.Size()),
+                 PartialSchedResult::Init(index, MemStateVec())});
 
     // Iterate |V| steps
-    auto nVert = group->seqs.size();
-    for (auto i : ProgressRange<displayProgress>(nVert)) {
-        decltype(memo) newMemo;
-        for (const auto &[zeroIn, result] : memo) {
-            // Add another vertex to the schedule
-            for (auto &vert : zeroIn) {
-                auto useCnt = result.useCnt;
-                auto vertResult =
-                    scheduleSequence(As<Sequence>(vert), useCnt,
-                                     budget - result.states.Latest());
-                updateResult(vert, zeroIn, result, std::move(vertResult),
-                             std::move(useCnt), newMemo);
-            }
-        }
+    auto nVert = index.Size();
+    auto optimal = true;
+    auto display = displayProgress && opts.displayProgress;
+    for (auto i : ProgressRange(nVert, display)) {
+        if (std::chrono::steady_clock::now() >= opts.deadline) return {};
+        auto newMemo = expandLayer(
+            index, memo, absBudget, opts.nThreads,
+            [&](const HierVertRef &vert,
+                std::unordered_map<ValueRef, uint32_t> &useCnt,
+                const PartialSchedResult &prev, size_t) {
+                return scheduleSequence(As<Sequence>(vert), useCnt,
+                                        budget - prev.latest);
+            });
         if (newMemo.empty()) return {};
+        if (truncateLayer(newMemo, opts)) optimal = false;
         newMemo.swap(memo);
     }
 
-    return memo[{}];
+    LOG_ASSERT(memo.size() == 1);
+    auto result = memo.begin()->second.Build();
+    result.optimal = optimal;
+    return result;
 }
 
-static void updateGroupUseCount(
-    const GroupRef &group, std::unordered_map<ValueRef, uint32_t> &useCnt) {
-    // Reduce use count consumed by this group
-    std::vector<ValueRef> killed;
-    for (const auto &[val, num] : group->consumed) {
-        useCnt[val] -= num;
-        if (useCnt[val] == 0) killed.push_back(val);
+/// Order ops of a group canonically, so that isomorphic groups in the same
+/// kill context usually get their ops in corresponding order. Ops are colored
+/// by their own attributes and then refined by colors of their neighbors.
+/// Ops are then topologically sorted, preferring ready op of lower color. Ties
+/// of equal color are broken by the order of `ops`, which may only cause
+/// isomorphic groups to be ordered differently.
+static std::vector<OpRef> canonicalOrder(
+    const std::vector<OpRef> &ops,
+    const std::unordered_map<ValueRef, uint32_t> &useCnt) {
+    // Index ops and count uses of values in this group
+    std::unordered_map<OpRef, uint32_t> opIdx;
+    for (auto [i, op] : EnumRange(ops)) opIdx.insert({op, uint32_t(i)});
+    std::unordered_map<ValueRef, uint32_t> groupUses;
+    for (auto &op : ops)
+        for (auto &val : op->inputs) groupUses[val]++;
+
+    // Find internal def-use edges as (def, output slot, use, input slot)
+    struct Edge {
+        uint32_t def, out, use, in;
+    };
+    std::vector<std::vector<Edge>> inEdges(ops.size()), outEdges(ops.size());
+    for (auto [u, op] : EnumRange(ops)) {
+        for (auto [i, val] : EnumRange(op->inputs)) {
+            if (val->kind != ValueKind::RESULT) continue;
+            auto def = val->def.lock();
+            if (!Contains(opIdx, def)) continue;
+            auto &defOuts = def->outputs;
+            Edge edge{opIdx[def],
+                      uint32_t(std::find(defOuts.begin(), defOuts.end(), val) -
+                               defOuts.begin()),
+                      uint32_t(u), uint32_t(i)};
+            inEdges[u].push_back(edge);
+            outEdges[edge.def].push_back(edge);
+        }
     }
 
-    // Erase killed values from use count map
-    for (auto &val : killed) useCnt.erase(val);
+    // Initialize colors with attributes of ops
+    std::vector<uint64_t> colors;
+    for (auto &op : ops) {
+        GroupKeyHasher hasher;
+        hasher.Add(op->type);
+        hasher.Add(OverlapInput(op));
+        hasher.Add(op->inputs.size());
+        for (auto &val : op->inputs) {
+            hasher.Add(uint64_t(val->kind));
+            hasher.Add(val->type.Size());
+            auto def = val->def.lock();
+            if (val->kind == ValueKind::PARAM || (def && Contains(opIdx, def)))
+                continue;
+            hasher.Add(useCnt.at(val) == groupUses[val]);
+        }
+        hasher.Add(op->outputs.size());
+        for (auto &val : op->outputs) {
+            hasher.Add(val->type.Size());
+            hasher.Add(val->uses.size());
+        }
+        colors.push_back(hasher.Key().lo);
+    }
+
+    // Refine colors until the number of distinct colors stops increasing
+    auto countColors = [](const std::vector<uint64_t> &colors) {
+        return std::unordered_set<uint64_t>(colors.begin(), colors.end())
+            .size();
+    };
+    auto nColors = countColors(colors);
+    for (auto round = 0u; round < ops.size(); round++) {
+        std::vector<uint64_t> newColors;
+        for (auto u = 0u; u < ops.size(); u++) {
+            GroupKeyHasher hasher;
+            hasher.Add(colors[u]);
+            for (auto &edge : inEdges[u]) {
+                hasher.Add(colors[edge.def]);
+                hasher.Add(edge.out);
+                hasher.Add(edge.in);
+            }
+            auto succs = Transform<std::vector<std::array<uint64_t, 3>>>(
+                outEdges[u], [&](auto &edge) {
+                    return std::array<uint64_t, 3>{colors[edge.use], edge.out,
+                                                   edge.in};
+                });
+            std::sort(succs.begin(), succs.end());
+            for (auto &succ : succs)
+                for (auto data : succ) hasher.Add(data);
+            newColors.push_back(hasher.Key().lo);
+        }
+        auto newNColors = countColors(newColors);
+        colors.swap(newColors);
+        if (newNColors == nColors) break;
+        nColors = newNColors;
+    }
+
+    // Topologically sort ops, preferring lower color
+    std::vector<uint32_t> predCnt(ops.size());
+    for (auto u = 0u; u < ops.size(); u++) predCnt[u] = inEdges[u].size();
+    std::set<std::pair<uint64_t, uint32_t>> ready;
+    for (auto u = 0u; u < ops.size(); u++)
+        if (predCnt[u] == 0) ready.insert({colors[u], u});
+    std::vector<OpRef> order;
+    while (!ready.empty()) {
+        auto u = ready.begin()->second;
+        ready.erase(ready.begin());
+        order.push_back(ops[u]);
+        for (auto &edge : outEdges[u])
+            if (--predCnt[edge.use] == 0)
+                ready.insert({colors[edge.use], edge.use});
+    }
+    LOG_ASSERT(order.size() == ops.size());
+
+    return order;
+}
+
+/// Compute key of group context in group cache. `ops` are all ops in the
+/// group, whose order defines group-local op indices. The key covers op types,
+/// value sizes, def-use chains inside the group, sequence boundaries and
+/// whether each input value is killed in the group.
+static GroupCacheKey groupCacheKey(
+    const HierGraph &hier, const std::vector<OpRef> &ops,
+    const std::unordered_map<ValueRef, uint32_t> &useCnt) {
+    // Index ops and count uses of values in this group
+    std::unordered_map<OpRef, uint32_t> opIdx;
+    for (auto [i, op] : EnumRange(ops)) opIdx.insert({op, uint32_t(i)});
+    std::unordered_map<ValueRef, uint32_t> groupUses;
+    for (auto &op : ops)
+        for (auto &val : op->inputs) groupUses[val]++;
+
+    // Hash each op
+    GroupKeyHasher hasher;
+    hasher.Add(ops.size());
+    std::unordered_map<ValueRef, uint32_t> extIdx;
+    for (auto &op : ops) {
+        hasher.Add(op->type);
+        hasher.Add(OverlapInput(op));
+        hasher.Add(hier.opToSeq.at(op)->ops.front() == op);
+        hasher.Add(op->inputs.size());
+        for (auto &val : op->inputs) {
+            hasher.Add(uint64_t(val->kind));
+            hasher.Add(val->type.Size());
+            if (val->kind == ValueKind::PARAM) continue;
+            auto def = val->def.lock();
+            if (def && Contains(opIdx, def)) {
+                // Defined in this group
+                hasher.Add(opIdx[def]);
+                hasher.Add(std::find(def->outputs.begin(), def->outputs.end(),
+                                     val) -
+                           def->outputs.begin());
+            } else {
+                // Defined outside, whose kill context matters
+                auto [it, _] = extIdx.insert({val, uint32_t(extIdx.size())});
+                hasher.Add(ops.size() + it->second);
+                hasher.Add(useCnt.at(val) == groupUses[val]);
+            }
+        }
+        hasher.Add(op->outputs.size());
+        for (auto &val : op->outputs) {
+            hasher.Add(val->type.Size());
+            hasher.Add(val->uses.size());
+        }
+    }
+
+    return hasher.Key();
+}
+
+/// Replay schedule of group found in group cache. The cached schedule is
+/// checked against `ops` of the group, so that a colliding key never produces
+/// an invalid schedule.
+static SchedResult replayGroupCache(
+    GroupCache &cache, const GroupCacheKey &key, const std::vector<OpRef> &ops,
+    const std::unordered_map<ValueRef, uint32_t> &useCnt) {
+    // Look up cache
+    auto entry = cache.Find(key);
+    if (!entry) return {};
+
+    // Map op indices to ops, checking that they form a topological order
+    std::unordered_map<OpRef, bool> scheduled;
+    for (auto &op : ops) scheduled.insert({op, false});
+    std::vector<OpRef> seq;
+    for (auto idx : entry->ops) {
+        if (idx >= ops.size() || scheduled[ops[idx]]) return {};
+        auto &op = ops[idx];
+        for (auto &pred : op->preds) {
+            auto predVert = pred.lock();
+            if (!Is<Op>(predVert)) continue;  // graph inputs
+            auto it = scheduled.find(Cast<Op>(predVert));
+            if (it != scheduled.end() && !it->second) return {};
+        }
+        scheduled[op] = true;
+        seq.push_back(op);
+    }
+    if (seq.size() != ops.size()) return {};
+
+    // Replay schedule and compare memory states
+    auto replayUseCnt = useCnt;
+    auto result = scheduleOps(seq, replayUseCnt, MAX_BUDGET);
+    if (result.states.Peak() != entry->peak ||
+        result.states.Latest() != entry->latest) {
+        LOG(WARNING) << "Cached group schedule does not match the group.";
+        return {};
+    }
+
+    return result;
+}
+
+/// Find schedule of group in group cache. Only schedules that pass the
+/// replay check are counted as hits.
+static SchedResult findGroupCache(
+    GroupCache &cache, const GroupCacheKey &key, const std::vector<OpRef> &ops,
+    const std::unordered_map<ValueRef, uint32_t> &useCnt) {
+    auto result = replayGroupCache(cache, key, ops, useCnt);
+    cache.Count(result.valid);
+    return result;
+}
 
-    // Add values produces by this group
-    useCnt.insert(group->produced.begin(), group->produced.end());
+/// Insert schedule of group to group cache
+static void insertGroupCache(GroupCache &cache, const GroupCacheKey &key,
+                             const std::vector<OpRef> &ops,
+                             const SchedResult &result) {
+    std::unordered_map<OpRef, uint32_t> opIdx;
+    for (auto [i, op] : EnumRange(ops)) opIdx.insert({op, uint32_t(i)});
+    cache.Insert(key, {result.states.Peak(), result.states.Latest(),
+                       Transform<std::vector<uint32_t>>(
+                           result.seq, [&](auto &op) { return opIdx[op]; })});
 }
 
 class HierScheduler {
 public:
     HierScheduler(const HierGraph &hier, int64_t budget,
-                  std::unordered_map<GroupContext, SchedResult> &groupMemo)
-        : hier(hier), budget(budget), groupMemo(groupMemo) {}
+                  std::unordered_map<GroupContext, SchedResult> &groupMemo,
+                  const SchedOptions &opts)
+        : hier(hier), budget(budget), groupMemo(groupMemo), opts(opts) {}
 
     std::vector<OpRef> Schedule() {
-        // Initialize predecessor count of vertices
-        std::unordered_map<HierVertRef, uint32_t> predCnt;
+        // Index vertices to be scheduled in reverse post-order
+        std::vector<HierVertRef> verts;
         for (auto vert : RpoHierRange(hier)) {
             if (Is<HierInput>(vert) || Is<HierOutput>(vert)) continue;
-            predCnt.insert({vert, uint32_t(vert->preds.size())});
+            verts.push_back(std::move(vert));
         }
-        auto nVert = predCnt.size();
-
         // Initialize use count of values
         std::unordered_map<ValueRef, uint32_t> useCnt;
         for (auto &input : hier.inputs) {
-            for (auto &succ : input->succs) predCnt[succ]--;
             auto &val = input->value;
             useCnt.insert({val, uint32_t(val->uses.size())});
         }
+        DpVertIndex index(std::move(verts), useCnt);
 
         // Initialize memoization map
-        std::vector<HierVertRef> zeroIn;
-        extractZeroIn(predCnt, zeroIn);
         auto initSize = std::transform_reduce(
             hier.inputs.begin(), hier.inputs.end(), 0ull, std::plus(),
             [](auto &input) { return input->value->type.Size(); });
-        std::unordered_map<std::vector<HierVertRef>, PartialSchedResult> memo;
-        memo.insert({zeroIn,
-                     {{},
-                      MemStateVec(initSize),
-                      std::move(predCnt),
-                      std::move(useCnt)}});
+        DpMemo memo;
+        memo.insert({FrontierKey(index.Size()),
+                     PartialSchedResult::Init(index, MemStateVec(initSize))});
 
         // Iterate |V| steps
-        for (auto i : ProgressRange(nVert)) {
+        for (auto i : ProgressRange(index.Size(), opts.displayProgress)) {
+            // Stop if deadline is reached
+            if (Expired()) return {};
+
             // Iterate each partial result and build partial schedule with one
             // more vertex
-            decltype(memo) newMemo;
-            for (const auto &[zeroIn, result] : memo) {
-                // Add another vertex to the schedule
-                for (auto &vert : zeroIn) {
-                    auto useCnt = result.useCnt;
-                    auto vertResult =
-                        scheduleVertex(vert, useCnt, result.states);
-                    updateResult(vert, zeroIn, result, std::move(vertResult),
-                                 std::move(useCnt), newMemo);
-                }
-            }
-            LOG_ASSERT(!newMemo.empty());
+            auto newMemo = expandLayer(
+                index, memo, budget, opts.nThreads,
+                [this](const HierVertRef &vert,
+                       std::unordered_map<ValueRef, uint32_t> &useCnt,
+                       const PartialSchedResult &prev, size_t nThreads) {
+                    return scheduleVertex(vert, useCnt, prev, nThreads);
+                });
+            // No schedule within budget, or deadline is reached
+            if (newMemo.empty() || Expired()) return {};
+            if (truncateLayer(newMemo, opts)) optimal = false;
             newMemo.swap(memo);
         }
 
-        return memo[{}].seq;
+        LOG_ASSERT(memo.size() == 1);
+        return memo.begin()->second.Build().seq;
+    }
+
+    /// Whether the last schedule is proved optimal for the hierarchical graph
+    bool Optimal() const { return optimal; }
+
+    /// Whether deadline of scheduling is reached
+    bool Expired() const {
+        return std::chrono::steady_clock::now() >= opts.deadline;
     }
 
 private:
     SchedResult scheduleVertex(const HierVertRef &vert,
                                std::unordered_map<ValueRef, uint32_t> &useCnt,
-                               const MemStateVec &prevStates) {
+                               const PartialSchedResult &prev,
+                               size_t nThreads) {
         // Compute budget for this vertex
-        auto localBudget = budget - prevStates.Latest();
+        auto localBudget = budget - prev.latest;
 
         // Schedule vertex according to its kind
         switch (vert->Kind()) {
@@ -380,41 +1219,72 @@ private:
                                         localBudget);
 
             case HierKind::GROUP: {
-                // Check if there is memoized result
+                // Try schedule using reverse post-order
+                // RPO is tried before looking up memoized DP results, so that
+                // the choice does not depend on which partial result is
+                // expanded first. RPO schedule only depends on group context,
+                // so it is also memoized.
                 auto group = Cast<Group>(vert);
                 GroupContext ctx(group, useCnt);
-                if (Contains(groupMemo, ctx)) {
+                auto rpoResult = scheduleGroupRpoMemo(ctx, group, useCnt);
+
+                // Use RPO schedule if peak is not lifted
+                auto rpoBudget = std::min(localBudget, prev.peak - prev.latest);
+                if (rpoResult.states.Peak() <= rpoBudget) return rpoResult;
+
+                // Check if there is memoized result
+                SchedResult memoResult;
+                {
+                    std::lock_guard<std::mutex> lock(memoMutex);
+                    auto it = groupMemo.find(ctx);
+                    if (it != groupMemo.end()) memoResult = it->second;
+                }
+                // Check if there is schedule of an isomorphic group in group
+                // cache. Group-local op indices follow the canonical order.
+                GroupCacheKey cacheKey;
+                std::vector<OpRef> canonOps;
+                if (!memoResult.valid) {
+                    canonOps = canonicalOrder(rpoResult.seq, useCnt);
+                    cacheKey = groupCacheKey(hier, canonOps, useCnt);
+                    memoResult = findGroupCache(*opts.groupCache, cacheKey,
+                                                canonOps, useCnt);
+                    if (memoResult.valid) {
+                        std::lock_guard<std::mutex> lock(memoMutex);
+                        groupMemo.insert({ctx, memoResult});
+                    }
+                }
+                if (memoResult.valid) {
                     // Check if it exceeds local budget
-                    auto &memoResult = groupMemo[ctx];
                     if (memoResult.states.Peak() > localBudget)
                         // Cannot schedule within budget, abandon this partial
                         // schedule
                         return {};
                     else {
-                        // Use memoized result, also update use count
-                        updateGroupUseCount(group, useCnt);
-                        return groupMemo[ctx];
+                        // Use memoized result
+                        if (!memoResult.optimal) optimal = false;
+                        return memoResult;
                     }
                 }
 
-                // Try schedule using reverse post-order
-                auto rpoUseCnt = useCnt;
-                auto rpoBudget = std::min(
-                    localBudget, prevStates.Peak() - prevStates.Latest());
-                auto rpoResult = scheduleGroupRpo(group, rpoUseCnt, rpoBudget);
-
-                // Use RPO schedule if peak is not lifted
-                if (rpoResult.valid) {
-                    useCnt.swap(rpoUseCnt);
-                    return rpoResult;
-                }
-
                 // Schedule group using DP and memoize the result
-                auto dpResult =
-                    scheduleGroupDp<false>(group, useCnt, localBudget);
-                if (!dpResult.valid) return {};
-                updateGroupUseCount(group, useCnt);
-                groupMemo.insert({ctx, dpResult});
+                auto groupOpts = opts;
+                groupOpts.nThreads = nThreads;
+                auto dpResult = scheduleGroupDp<false>(
+                    group, useCnt, localBudget, budget, groupOpts);
+                if (!dpResult.valid) {
+                    // Beam limit may drop schedules within budget
+                    if (opts.beamWidth != 0 || opts.maxLayerBytes != 0)
+                        optimal = false;
+                    return {};
+                }
+                if (!dpResult.optimal) optimal = false;
+                {
+                    std::lock_guard<std::mutex> lock(memoMutex);
+                    groupMemo.insert({ctx, dpResult});
+                }
+                if (dpResult.optimal)
+                    insertGroupCache(*opts.groupCache, cacheKey, canonOps,
+                                     dpResult);
                 return dpResult;
             }
 
@@ -424,12 +1294,37 @@ private:
         LOG(FATAL) << "Unreachable.";
     }
 
+    /// Schedule group with reverse post-order without budget, reusing result
+    /// of the same context
+    SchedResult scheduleGroupRpoMemo(
+        const GroupContext &ctx, const GroupRef &group,
+        const std::unordered_map<ValueRef, uint32_t> &useCnt) {
+        {
+            std::lock_guard<std::mutex> lock(memoMutex);
+            auto it = rpoMemo.find(ctx);
+            if (it != rpoMemo.end()) return it->second;
+        }
+        auto rpoUseCnt = useCnt;
+        auto result = scheduleGroupRpo(group, rpoUseCnt, MAX_BUDGET);
+        std::lock_guard<std::mutex> lock(memoMutex);
+        rpoMemo.insert({ctx, result});
+        return result;
+    }
+
     /// Hierarchical graph to be scheduled
     const HierGraph &hier;
     /// Upper bound of acceptable peak
     const int64_t budget;
     /// Scheduling result of each group, under different contexts
     std::unordered_map<GroupContext, SchedResult> &groupMemo;
+    /// Reverse post-order schedule of each group, under different contexts
+    std::unordered_map<GroupContext, SchedResult> rpoMemo;
+    /// Guard memoization maps when expanding with multiple threads
+    std::mutex memoMutex;
+    /// Scheduling options
+    const SchedOptions &opts;
+    /// Whether no partial schedule is dropped because of beam limit
+    std::atomic<bool> optimal{true};
 };
 
 using VertListFunc =
@@ -524,30 +1419,162 @@ static bool tryUngroupSucc(const SequenceRef &seq) {
     return changed;
 }
 
-// Make sure subtracting any integer (positive or negative) not so big from it
-// will never overflow.
-static constexpr auto MAX_BUDGET = INT64_MAX / 2;
+/// Ungrouping of a hierarchical graph
+/// Actions refer to ops instead of vertices, so that they can be replayed on
+/// another hierarchical graph built from the same computation graph.
+struct UngroupAction {
+    /// Op in the sequence to be considered
+    OpRef op;
+    /// Whether to ungroup successor groups of the sequence, instead of the
+    /// group containing it
+    bool succ;
+
+    bool operator==(const UngroupAction &other) const {
+        return this->op == other.op && this->succ == other.succ;
+    }
+};
 
-std::vector<OpRef> HierarchicalSchedule(const Graph &graph) {
-    // Build hierarchical graph
+/// Apply ungrouping actions to hierarchical graph. Return whether the graph is
+/// changed.
+static bool applyUngroup(HierGraph &hier,
+                         const std::vector<UngroupAction> &actions) {
+    bool changed = false;
+    for (auto &[op, succ] : actions) {
+        auto &seq = hier.opToSeq[op];
+        if (succ)
+            changed |= tryUngroupSucc(seq);
+        else if (auto group = seq->group.lock()) {
+            ungroup(group);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/// Schedule hierarchical graph within budget. If there is no schedule within
+/// budget, schedule again without budget. Return empty schedule if deadline is
+/// reached. `optimal` is cleared if the schedule may not be optimal.
+static std::vector<OpRef> scheduleHier(
+    const HierGraph &hier, int64_t budget,
+    std::unordered_map<GroupContext, SchedResult> &groupMemo,
+    const SchedOptions &opts, bool &optimal) {
+    HierScheduler scheduler(hier, budget, groupMemo, opts);
+    auto sched = scheduler.Schedule();
+    optimal = optimal && scheduler.Optimal();
+    if (sched.empty() && !scheduler.Expired()) {
+        // No schedule is found within the incumbent peak. Schedule again
+        // without budget, so that peak values can still be located.
+        HierScheduler unbounded(hier, MAX_BUDGET, groupMemo, opts);
+        sched = unbounded.Schedule();
+        optimal = optimal && unbounded.Optimal();
+    }
+    return sched;
+}
+
+/// Candidate ungrouping in speculative mode
+struct UngroupCandidate {
+    std::vector<UngroupAction> actions;
+    std::vector<OpRef> sched;
+    uint64_t peak = MAX_BUDGET;
+    bool optimal = true;
+};
+
+/// Schedule each candidate on its own copy of hierarchical graph, which is
+/// built from `graph` and then ungrouped by `history`. Dominator trees of
+/// `base` are reused by the copies. Peaks are estimated on `flat`.
+static void evalCandidates(const Graph &graph, const FlatGraph &flat,
+                           const HierGraph &base,
+                           const std::vector<UngroupAction> &history,
+                           std::vector<UngroupCandidate> &cands,
+                           int64_t budget, const SchedOptions &opts) {
+    auto candOpts = opts;
+    candOpts.nThreads = std::max(opts.nThreads / cands.size(), size_t(1));
+    ParallelFor(cands.size(), [&](size_t i) {
+        // Build hierarchical graph of this candidate
+        auto &cand = cands[i];
+        HierGraph hier(graph);
+        hier.dom = base.dom;
+        hier.postDom = base.postDom;
+        RunPass<JoinSequencePass, MakeGroupPass>(hier);
+        applyUngroup(hier, history);
+        if (!applyUngroup(hier, cand.actions)) return;
+
+        // Schedule this candidate
+        std::unordered_map<GroupContext, SchedResult> groupMemo;
+        cand.sched = scheduleHier(hier, budget, groupMemo, candOpts,
+                                  cand.optimal);
+        if (!cand.sched.empty())
+            cand.peak = flat.EstimatePeak(cand.sched);
+    });
+}
+
+std::vector<OpRef> HierarchicalSchedule(const Graph &graph,
+                                        const SchedOptions &schedOpts,
+                                        HierSchedStat *schedStat) {
+    // Isomorphic groups share schedules through group cache. Use one in memory
+    // if no cache is given.
+    GroupCache localCache;
+    auto opts = schedOpts;
+    if (!opts.groupCache) opts.groupCache = &localCache;
+
+    // Build hierarchical graph, and compile graph for evaluating schedules
     HierGraph hier(graph);
     RunPass<JoinSequencePass, MakeGroupPass>(hier);
+    FlatGraph flat(graph);
 
     // Initialize memoization map for sharing results across iterations
     std::unordered_map<GroupContext, SchedResult> groupMemo;
 
-    // Record schedule and peak
-    std::vector<OpRef> lastSched;
-    uint64_t lastPeak = MAX_BUDGET;
+    // Record schedule and peak. Reverse post-order schedule is used as the
+    // initial incumbent, so that partial schedules exceeding its peak are
+    // pruned in the first iteration. It is also returned if the deadline is
+    // reached before any iteration finishes.
+    auto lastSched = ReversePostOrder(graph);
+    uint64_t lastPeak = flat.EstimatePeak(lastSched);
+    auto incumbentIsRpo = true;
 
     // Iteratively schedule hierarchical graph
-    while (true) {
-        auto sched = HierScheduler(hier, lastPeak, groupMemo).Schedule();
+    HierSchedStat localStat;
+    if (!schedStat) schedStat = &localStat;
+    *schedStat = {};
+    std::vector<UngroupAction> history;
+    std::vector<OpRef> nextSched;
+    auto nextOptimal = true;
+    while (std::chrono::steady_clock::now() < opts.deadline) {
+        auto iterBegin = std::chrono::steady_clock::now();
+        auto iterEnd = [&] {
+            auto elapsed = std::chrono::steady_clock::now() - iterBegin;
+            schedStat->iterTimes.push_back(elapsed);
+            LOG(INFO) << fmt::format(
+                "Iteration {} takes {} ms.", schedStat->iterTimes.size(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+                    .count());
+        };
+
+        // Schedule hierarchical graph, unless it has been scheduled when
+        // evaluating ungroup candidates
+        auto optimal = nextOptimal;
+        auto sched = std::move(nextSched);
+        if (sched.empty())
+            sched = scheduleHier(hier, lastPeak, groupMemo, opts, optimal);
+        nextSched.clear();
+        nextOptimal = true;
+        if (sched.empty()) {
+            LOG(INFO) << "Deadline is reached.";
+            iterEnd();
+            break;
+        }
+        if (!optimal) {
+            schedStat->nTruncated++;
+            LOG(WARNING) << "Beam limit is reached. Schedule of this iteration "
+                            "may not be optimal.";
+        }
         LOG_ASSERT(sched.size() == graph.ops.size());
-        auto stat = ComputeLifetime(sched, graph);
+        auto compiled = flat.Compile(sched);
+        auto stat = flat.ComputeLifetime(compiled);
 
         // Find peak and peak values
-        auto peak = EstimatePeak(sched, graph.inputs);
+        auto peak = flat.EstimatePeak(compiled);
         std::set<ValueRef> peakValues;
         auto sizeRange = stat.SizeRange();
         for (auto it = sizeRange.begin(); it != sizeRange.end(); ++it) {
@@ -561,65 +1588,251 @@ std::vector<OpRef> HierarchicalSchedule(const Graph &graph) {
         LOG(INFO) << "Peak: " << peak / 1024;
         for (auto &val : peakValues) LOG(INFO) << val->name;
 
-        // Update peak and schedule
-        if (peak < lastPeak) {
+        // Update peak and schedule. Hierarchical schedule is preferred to
+        // reverse post-order one of the same peak.
+        if (peak < lastPeak || (incumbentIsRpo && peak == lastPeak)) {
             lastPeak = peak;
             lastSched = sched;
+            incumbentIsRpo = false;
         }
 
         // Locate sequences related to this peak
         std::unordered_set<SequenceRef> relSeqs;
-        for (auto &val : peakValues)
+        for (auto &val : peakValues) {
+            if (val->kind != ValueKind::RESULT) continue;  // graph inputs
             relSeqs.insert(hier.opToSeq[val->def.lock()]);
+        }
 
-        // Ungroup
-        bool changed = false;
+        // Ungroup those which contains peak sequences, as well as successor
+        // groups of peak sequences
+        std::vector<UngroupAction> actions;
         for (auto &seq : relSeqs) {
-            // Ungroups those which contains peak sequences
-            auto group = seq->group.lock();
-            if (group != nullptr) {
-                ungroup(group);
-                changed = true;
+            actions.push_back({seq->ops.front(), false});
+            actions.push_back({seq->ops.front(), true});
+        }
+        if (opts.speculativeUngroup) {
+            // Consider all actions together, and each effective action alone
+            std::vector<UngroupCandidate> cands{{actions}};
+            for (auto &action : actions) {
+                auto &seq = hier.opToSeq[action.op];
+                auto effective =
+                    action.succ
+                        ? std::any_of(seq->succs.begin(), seq->succs.end(),
+                                      [](auto &succ) { return Is<Group>(succ); })
+                        : seq->group.lock() != nullptr;
+                if (effective) cands.push_back({{action}});
+            }
+            if (cands.size() == 2) cands.pop_back();
+
+            // Keep the candidate with lowest peak
+            evalCandidates(graph, flat, hier, history, cands, lastPeak,
+                           opts);
+            auto best = std::min_element(
+                cands.begin(), cands.end(),
+                [](auto &lhs, auto &rhs) { return lhs.peak < rhs.peak; });
+            if (!best->sched.empty()) {
+                actions = best->actions;
+                nextSched = std::move(best->sched);
+                nextOptimal = best->optimal;
             }
-
-            // Ungroup successor groups of peak sequences
-            changed |= tryUngroupSucc(seq);
         }
+        bool changed = applyUngroup(hier, actions);
+        Extend(history, actions);
 
         // Break if nothing more can be done to the graph
-        if (!changed) break;
+        iterEnd();
+        if (!changed) {
+            schedStat->converged = true;
+            break;
+        }
     }
 
+    // Report statistics of group cache
+    LOG(INFO) << fmt::format("Group cache: {} hits, {} misses, {} entries.",
+                             opts.groupCache->Hits(), opts.groupCache->Misses(),
+                             opts.groupCache->Size());
+
     return lastSched;
 }
 
-static int64_t sampleGroupPeak(const GroupRef &group,
-                               std::unordered_map<ValueRef, uint32_t> useCnt,
-                               std::mt19937 &rng) {
-    // Initialize predecessor count map
-    std::unordered_map<SequenceRef, uint32_t> predCnt;
-    for (auto &seq : group->seqs)
-        predCnt.insert({seq, uint32_t(seq->preds.size())});
+/// Sampler of peaks of random schedules of a group
+/// Sequences, ops and values of the group are densely indexed once, so that
+/// each sample only copies and updates arrays.
+class GroupSampler {
+public:
+    /// `useCnt` is the use count of values before the group is scheduled.
+    GroupSampler(const GroupRef &group,
+                 const std::unordered_map<ValueRef, uint32_t> &useCnt)
+        : predCnt(group->seqs.size(), 0), seqSuccs(group->seqs.size()) {
+        // Build successor lists of sequences in group
+        std::unordered_map<SequenceRef, uint32_t> seqIdx;
+        for (auto [i, seq] : EnumRange(group->seqs))
+            seqIdx.insert({seq, uint32_t(i)});
+        for (auto [i, seq] : EnumRange(group->seqs)) {
+            for (auto &succ : seq->succs) {
+                if (!Is<Sequence>(succ)) continue;
+                auto it = seqIdx.find(Cast<Sequence>(succ));
+                if (it == seqIdx.end()) continue;
+                seqSuccs[i].push_back(it->second);
+                predCnt[it->second]++;
+            }
+        }
 
-    // Initialize zero indegree set
-    std::vector<SequenceRef> zeroIn;
-    extractZeroIn(predCnt, zeroIn);
+        // Number values, and record inputs and outputs of each op
+        std::unordered_map<ValueRef, uint32_t> valIdx;
+        auto getValue = [&](const ValueRef &val) {
+            auto [it, inserted] =
+                valIdx.insert({val, uint32_t(valSize.size())});
+            if (inserted) {
+                valSize.push_back(val->type.Size());
+                auto cntIt = useCnt.find(val);
+                baseCnt.push_back(cntIt == useCnt.end()
+                                      ? uint32_t(val->uses.size())
+                                      : cntIt->second);
+            }
+            return it->second;
+        };
+        seqBegin.push_back(0);
+        for (auto &seq : group->seqs) {
+            for (auto &op : seq->ops) {
+                OpInfo info;
+                for (auto &val : op->inputs) {
+                    if (val->kind == ValueKind::PARAM) continue;
+                    auto v = getValue(val);
+                    auto it = std::find_if(
+                        info.inputs.begin(), info.inputs.end(),
+                        [&](auto &use) { return use.first == v; });
+                    if (it == info.inputs.end())
+                        info.inputs.push_back({v, 1});
+                    else
+                        it->second++;
+                }
+                for (auto &val : op->outputs) {
+                    getValue(val);
+                    info.outSize += val->type.Size();
+                }
+                auto ovlIdx = OverlapInput(op);
+                if (ovlIdx != OVERLAP_FAILED)
+                    info.ovlValue = getValue(op->inputs[ovlIdx]);
+                ops.push_back(std::move(info));
+            }
+            seqBegin.push_back(uint32_t(ops.size()));
+        }
+    }
 
-    // Sample one schedule
-    std::vector<OpRef> sched;
-    MemStateVec states;
-    while (!predCnt.empty()) {
-        auto seq = sampleVertex(predCnt, zeroIn, rng);
-        auto result = scheduleSequence(seq, useCnt, MAX_BUDGET);
-        Extend(sched, result.seq);
-        states.Extend(result.states);
+    /// Sample a schedule of the group and return its peak, relative to memory
+    /// before the group is scheduled
+    int64_t SamplePeak(std::mt19937 &rng) const {
+        auto useCnt = baseCnt;
+        int64_t mem = 0, peak = 0;
+        sampleTopoOrder(predCnt, seqSuccs, rng, [&](uint32_t s) {
+            for (auto i = seqBegin[s]; i < seqBegin[s + 1]; i++) {
+                // Memory changes follow `ComputeIncDec`. A killed value is
+                // freed once for each time it is used by this op.
+                auto &op = ops[i];
+                int64_t inc = op.outSize, dec = 0;
+                for (auto [v, count] : op.inputs) {
+                    useCnt[v] -= count;
+                    if (useCnt[v] != 0) continue;
+                    if (v == op.ovlValue)
+                        inc = 0;
+                    else
+                        dec += valSize[v] * count;
+                }
+                peak = std::max(peak, mem + inc);
+                mem += inc - dec;
+            }
+        });
+        return peak;
+    }
+
+private:
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+
+    struct OpInfo {
+        /// Non-parameter inputs, with number of uses by this op
+        std::vector<std::pair<uint32_t, uint32_t>> inputs;
+        /// Total size of outputs
+        int64_t outSize = 0;
+        /// Input value that the output can overlap
+        uint32_t ovlValue = NO_VALUE;
+    };
+
+    /// Number of predecessors and successors of each sequence in group
+    std::vector<uint32_t> predCnt;
+    std::vector<std::vector<uint32_t>> seqSuccs;
+    /// Ops of all sequences, where ops of sequence `s` are in range
+    /// `[seqBegin[s], seqBegin[s + 1])`
+    std::vector<OpInfo> ops;
+    std::vector<uint32_t> seqBegin;
+    /// Size and use count of each value before the group is scheduled
+    std::vector<int64_t> valSize;
+    std::vector<uint32_t> baseCnt;
+};
+
+/// Seed of random number generator of sample `index` in `stream`. Each sample
+/// has its own generator, so that sampled peaks do not depend on how samples
+/// are distributed to threads.
+static uint32_t sampleSeed(uint64_t seed, uint64_t stream, uint64_t index) {
+    // SplitMix64 finalizer
+    auto mix = [](uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    };
+    return uint32_t(mix(mix(mix(seed) ^ stream) ^ index));
+}
+
+/// Find budget of a group, which is the lowest peak of `nSamples` sampled
+/// schedules. Samples are drawn in chunks on `opts.nThreads` threads and then
+/// checked in order, so the result does not depend on the number of threads.
+static int64_t sampleGroupBudget(const GroupSampler &sampler, uint64_t stream,
+                                 size_t nSamples, const SchedOptions &opts) {
+    // Without early stopping, all samples are drawn at once. Otherwise, at most
+    // one chunk of samples beyond the stopping point is wasted.
+    auto patience = opts.samplePatience;
+    auto nThreads = std::max(opts.nThreads, size_t(1));
+    auto chunkSize = patience == 0 ? nSamples : std::max(patience, nThreads);
+
+    auto budget = MAX_BUDGET;
+    size_t lastImproved = 0;
+    std::vector<int64_t> peaks;
+    for (size_t begin = 0; begin < nSamples; begin += chunkSize) {
+        // Draw samples in this chunk
+        auto end = std::min(begin + chunkSize, nSamples);
+        peaks.assign(end - begin, 0);
+        std::atomic<size_t> next{begin};
+        ParallelFor(std::min(nThreads, end - begin), [&](size_t) {
+            for (auto i = next++; i < end; i = next++) {
+                std::mt19937 rng(sampleSeed(opts.sampleSeed, stream, i));
+                peaks[i - begin] = sampler.SamplePeak(rng);
+            }
+        });
+
+        // Update budget, and stop if it is not improved for a while
+        for (auto i = begin; i < end; i++) {
+            if (peaks[i - begin] < budget) {
+                budget = peaks[i - begin];
+                lastImproved = i;
+            } else if (patience != 0 && i - lastImproved >= patience) {
+                LOG(INFO) << fmt::format("Sampling stops after {} samples.",
+                                         i + 1);
+                return budget;
+            }
+        }
     }
 
-    return states.Peak();
+    return budget;
 }
 
 std::vector<OpRef> SerenitySchedule(const Graph &graph, bool joinOps,
-                                    bool trySimple, size_t nSamples) {
+                                    bool trySimple, size_t nSamples,
+                                    const SchedOptions &schedOpts) {
+    // Deadline only applies to hierarchical scheduling
+    auto opts = schedOpts;
+    opts.deadline = std::chrono::steady_clock::time_point::max();
+
     // Create hierarchical graph
     HierGraph hier(graph);
     if (joinOps) RunPass<JoinSequencePass>(hier);
@@ -673,15 +1886,26 @@ std::vector<OpRef> SerenitySchedule(const Graph &graph, bool joinOps,
                 }
 
                 // Sample budget for this group
-                auto budget = MAX_BUDGET;
-                std::mt19937 rng;
+                GroupSampler sampler(group, useCnt);
                 LOG(INFO) << "Sampling schedules.";
-                for (auto _ : ProgressRange<true>(nSamples))
-                    budget = std::min(budget, sampleGroupPeak(group, useCnt, rng));
+                auto budget = sampleGroupBudget(sampler, i, nSamples, opts);
 
                 // Schedule group with sampled budget
                 LOG(INFO) << fmt::format("Scheduling group with budget {} KB.", budget / 1024);
-                auto result = scheduleGroupDp<true>(group, useCnt, budget);
+                // Lower bounds are not used, as memory states here do not count
+                // all graph inputs.
+                auto result = scheduleGroupDp<true>(group, useCnt, budget,
+                                                    MAX_BUDGET, opts);
+                if (!result.valid) {
+                    // Schedules within sampled budget may be dropped by beam
+                    // limit
+                    LOG(INFO) << "Rescheduling group without budget.";
+                    result = scheduleGroupDp<true>(group, useCnt, MAX_BUDGET,
+                                                   MAX_BUDGET, opts);
+                }
+                if (!result.optimal)
+                    LOG(WARNING) << "Beam limit is reached. Schedule of this "
+                                    "group may not be optimal.";
                 Extend(sched, result.seq);
                 states.Extend(result.states);
             }
@@ -0,0 +1,104 @@
+#include <hmcos/util/flow.hpp>
+#include <hmcos/util/util.hpp>
+
+namespace hmcos {
+
+void FlowNetwork::AddEdge(uint32_t from, uint32_t to, uint64_t cap) {
+    adj[from].push_back(uint32_t(edges.size()));
+    edges.push_back({to, cap});
+    adj[to].push_back(uint32_t(edges.size()));
+    edges.push_back({from, 0});
+}
+
+uint64_t FlowNetwork::MaxFlow(uint32_t src, uint32_t sink) {
+    uint64_t total = 0;
+    while (buildLevels(src, sink)) {
+        next.assign(adj.size(), 0);
+        total += augment(src, sink);
+    }
+    return total;
+}
+
+std::vector<bool> FlowNetwork::ReachSink(uint32_t sink) const {
+    std::vector<bool> reach(adj.size(), false);
+    std::vector<uint32_t> queue{sink};
+    reach[sink] = true;
+    for (size_t i = 0; i < queue.size(); i++) {
+        for (auto e : adj[queue[i]]) {
+            auto from = edges[e].to;
+            if (reach[from] || edges[e ^ 1].cap == 0) continue;
+            reach[from] = true;
+            queue.push_back(from);
+        }
+    }
+    return reach;
+}
+
+static constexpr auto UNREACHED = UINT32_MAX;
+
+bool FlowNetwork::buildLevels(uint32_t src, uint32_t sink) {
+    level.assign(adj.size(), UNREACHED);
+    std::vector<uint32_t> queue{src};
+    level[src] = 0;
+    for (size_t i = 0; i < queue.size(); i++) {
+        auto u = queue[i];
+        for (auto e : adj[u]) {
+            auto &edge = edges[e];
+            if (edge.cap == 0 || level[edge.to] != UNREACHED) continue;
+            level[edge.to] = level[u] + 1;
+            queue.push_back(edge.to);
+        }
+    }
+    return level[sink] != UNREACHED;
+}
+
+uint64_t FlowNetwork::augment(uint32_t src, uint32_t sink) {
+    uint64_t total = 0;
+    std::vector<uint32_t> path;
+    auto tail = [&](uint32_t e) { return edges[e ^ 1].to; };
+    auto u = src;
+    while (true) {
+        // Push flow along the path and retreat to its first saturated edge
+        if (u == sink) {
+            auto flow = std::transform_reduce(
+                path.begin(), path.end(), UINT64_MAX,
+                [](uint64_t a, uint64_t b) { return std::min(a, b); },
+                [&](uint32_t e) { return edges[e].cap; });
+            for (auto e : path) {
+                edges[e].cap -= flow;
+                edges[e ^ 1].cap += flow;
+            }
+            total += flow;
+            auto sat = std::find_if(path.begin(), path.end(), [&](uint32_t e) {
+                return edges[e].cap == 0;
+            });
+            u = tail(*sat);
+            path.erase(sat, path.end());
+            continue;
+        }
+
+        // Advance along an admissible edge
+        auto &adjU = adj[u];
+        while (next[u] < adjU.size()) {
+            auto &edge = edges[adjU[next[u]]];
+            if (edge.cap > 0 && level[edge.to] == level[u] + 1) break;
+            next[u]++;
+        }
+        if (next[u] < adjU.size()) {
+            auto e = adjU[next[u]];
+            path.push_back(e);
+            u = edges[e].to;
+            continue;
+        }
+
+        // Retreat from a dead end
+        level[u] = UNREACHED;
+        if (path.empty()) break;
+        u = tail(path.back());
+        path.pop_back();
+        next[u]++;
+    }
+    return total;
+}
+
+}  // namespace hmcos
@@ -24,4 +24,10 @@ bool IsReinterpret(const std::string &name) {
     return Contains(reinterpOps, name);
 }
 
+OpKind GetOpKind(const std::string &type) {
+    if (IsElementWise(type)) return OpKind::ELEMENT_WISE;
+    if (IsReinterpret(type)) return OpKind::REINTERPRET;
+    return OpKind::OTHER;
+}
+
 }  // namespace hmcos
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <hmcos/util/parallel.hpp>
+
+namespace hmcos {
+
+ThreadPool::ThreadPool(size_t nThreads) {
+    threads.reserve(nThreads);
+    for (auto i = size_t(0); i < nThreads; i++)
+        threads.emplace_back([this] { loop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+    }
+    notEmpty.notify_all();
+    for (auto &thread : threads) thread.join();
+}
+
+ThreadPool &ThreadPool::Global() {
+    static ThreadPool pool(
+        std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    return pool;
+}
+
+void ThreadPool::Run(size_t n, const std::function<void(size_t)> &func) {
+    // Let pool threads join this job, no more than its iterations
+    auto job = std::make_shared<Job>();
+    job->func = &func;
+    job->n = n;
+    auto nJoin = std::min(n - 1, threads.size());
+    if (nJoin > 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto i = size_t(0); i < nJoin; i++) queue.push_back(job);
+        }
+        if (nJoin == 1)
+            notEmpty.notify_one();
+        else
+            notEmpty.notify_all();
+    }
+
+    // Run iterations on this thread, and wait for those claimed by others
+    func(0);
+    work(*job);
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&] { return job->nDone == n - 1; });
+}
+
+void ThreadPool::work(Job &job) {
+    for (auto i = job.next++; i < job.n; i = job.next++) {
+        (*job.func)(i);
+        std::lock_guard<std::mutex> lock(job.mutex);
+        if (++job.nDone == job.n - 1) job.finished.notify_all();
+    }
+}
+
+void ThreadPool::loop() {
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [&] { return stopped || !queue.empty(); });
+            if (queue.empty()) return;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        work(*job);
+    }
+}
+
+}  // namespace hmcos
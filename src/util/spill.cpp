@@ -0,0 +1,129 @@
+#include <glog/logging.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <hmcos/util/spill.hpp>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace hmcos {
+
+/// Data is written to file when buffer exceeds this size
+static constexpr size_t SPILL_BUFFER_SIZE = 1 << 20;
+
+#if defined(WIN32)
+
+SpillFile::SpillFile(const std::string &dir) {
+    char path[MAX_PATH];
+    if (GetTempFileNameA(dir.c_str(), "hms", 0, path) == 0)
+        LOG(FATAL) << "Cannot create spill file in " << dir << ".";
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                       CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                       nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        LOG(FATAL) << "Cannot open spill file " << path << ".";
+}
+
+SpillFile::~SpillFile() {
+    Unmap();
+    CloseHandle(file);
+}
+
+void SpillFile::flush() {
+    if (buf.empty()) return;
+    DWORD written = 0;
+    if (!WriteFile(file, buf.data(), DWORD(buf.size()), &written, nullptr) ||
+        written != buf.size())
+        LOG(FATAL) << "Cannot write to spill file.";
+    fileSize += buf.size();
+    buf.clear();
+}
+
+const char *SpillFile::Map() {
+    flush();
+    if (mapped || fileSize == 0) return mapped;
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) LOG(FATAL) << "Cannot map spill file.";
+    mapped = static_cast<const char *>(
+        MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!mapped) LOG(FATAL) << "Cannot map spill file.";
+    return mapped;
+}
+
+void SpillFile::Unmap() {
+    if (!mapped) return;
+    UnmapViewOfFile(mapped);
+    CloseHandle(mapping);
+    mapped = nullptr;
+    mapping = nullptr;
+}
+
+#else
+
+SpillFile::SpillFile(const std::string &dir) {
+    // Create a unique file and unlink it immediately, so that it is removed
+    // when closed, even if the process is killed
+    auto path = (std::filesystem::path(dir) / "hmcos-XXXXXX").string();
+    fd = mkstemp(path.data());
+    if (fd < 0)
+        LOG(FATAL) << "Cannot create spill file in " << dir << ": "
+                   << strerror(errno) << ".";
+    unlink(path.c_str());
+}
+
+SpillFile::~SpillFile() {
+    Unmap();
+    close(fd);
+}
+
+void SpillFile::flush() {
+    auto data = buf.data();
+    auto size = buf.size();
+    while (size > 0) {
+        auto written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            LOG(FATAL) << "Cannot write to spill file: " << strerror(errno)
+                       << ".";
+        }
+        data += written;
+        size -= written;
+    }
+    fileSize += buf.size();
+    buf.clear();
+}
+
+const char *SpillFile::Map() {
+    flush();
+    if (mapped || fileSize == 0) return mapped;
+    auto addr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        LOG(FATAL) << "Cannot map spill file: " << strerror(errno) << ".";
+    mapped = static_cast<const char *>(addr);
+    return mapped;
+}
+
+void SpillFile::Unmap() {
+    if (!mapped) return;
+    munmap(const_cast<char *>(mapped), fileSize);
+    mapped = nullptr;
+}
+
+#endif
+
+void SpillFile::Append(const void *data, size_t size) {
+    LOG_ASSERT(!mapped);
+    auto bytes = static_cast<const char *>(data);
+    buf.insert(buf.end(), bytes, bytes + size);
+    if (buf.size() >= SPILL_BUFFER_SIZE) flush();
+}
+
+}  // namespace hmcos